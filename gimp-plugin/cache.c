@@ -0,0 +1,266 @@
+/*
+ * Written 2003 Lukas Kunc <Lukas.Kunc@seznam.cz>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "cache.h"
+
+/*
+* Every entry is one file named by the SHA-1 of its key in the user's
+* cache directory: the header below, the coefficients of the factors and
+* the weights, all doubles in the byte order of this machine.  The file
+* is mapped and checked against the header before anything is copied.
+*/
+
+#define CACHE_MAGIC "RFCACHE"
+#define CACHE_SUFFIX ".psf"
+
+typedef struct
+{
+	gchar          magic[8];
+	guint32        version;
+	guint32        count;
+	SCacheKey      key;
+	gint32         radius[PSF_MAX_FACTORS];
+	gint32         wradius;
+	gint32         rxnz;
+	gint32         rynz;
+	gint32         reserved;
+} SCacheHeader;
+
+typedef struct
+{
+	gchar         *path;
+	time_t         mtime;
+	gsize          size;
+} SCacheEntry;
+
+static gchar* cache_dir(void)
+{
+	return g_build_filename(g_get_user_cache_dir(), PACKAGE_NAME, NULL);
+}
+
+static gchar* cache_path(const SCacheKey* key)
+{
+	gchar *dir, *sum, *name, *path;
+
+	/* the version is part of the address, old files are never read */
+	sum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, (const guchar*)key, sizeof(SCacheKey));
+	name = g_strdup_printf("%s-%d%s", sum, CACHE_VERSION, CACHE_SUFFIX);
+	dir = cache_dir();
+	path = g_build_filename(dir, name, NULL);
+	g_free(dir);
+	g_free(name);
+	g_free(sum);
+	return path;
+}
+
+/* doubles stored after the header */
+static gsize cache_count(const SCacheHeader* header)
+{
+	gsize n, r21;
+	guint k;
+
+	n = 0;
+	for (k = 0; k < header->count; k++)
+	{
+		r21 = 2 * header->radius[k] + 1;
+		n += r21 * r21;
+	}
+	r21 = 4 * header->wradius + 1;
+	return n + r21 * r21;
+}
+
+static gboolean cache_header_valid(const SCacheHeader* header, const SCacheKey* key, gsize length)
+{
+	guint k;
+
+	if (length < sizeof(SCacheHeader) || memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) ||
+	    header->version != CACHE_VERSION || header->count > PSF_MAX_FACTORS ||
+	    memcmp(&header->key, key, sizeof(SCacheKey)))
+		return FALSE;
+	for (k = 0; k < header->count; k++)
+		if (header->radius[k] < 0)
+			return FALSE;
+	if (header->wradius < 0 || header->rxnz < 0 || header->rynz < 0 ||
+	    header->rxnz > 2 * header->wradius || header->rynz > 2 * header->wradius)
+		return FALSE;
+	return length == sizeof(SCacheHeader) + sizeof(gdouble) * cache_count(header);
+}
+
+static gint cache_entry_compare(gconstpointer a, gconstpointer b)
+{
+	time_t ta = ((const SCacheEntry*)a)->mtime;
+	time_t tb = ((const SCacheEntry*)b)->mtime;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+/* Removes the least recently used entries until the rest fit into
+ * CACHE_MAX_SIZE. */
+static void cache_evict(void)
+{
+	GDir *dir;
+	GArray *entries;
+	SCacheEntry entry;
+	GStatBuf st;
+	const gchar *name;
+	gchar *path;
+	gsize total;
+	guint k;
+
+	path = cache_dir();
+	dir = g_dir_open(path, 0, NULL);
+	if (!dir)
+	{
+		g_free(path);
+		return;
+	}
+	entries = g_array_new(FALSE, FALSE, sizeof(SCacheEntry));
+	total = 0;
+	while ((name = g_dir_read_name(dir)))
+	{
+		if (!g_str_has_suffix(name, CACHE_SUFFIX))
+			continue;
+		entry.path = g_build_filename(path, name, NULL);
+		if (g_stat(entry.path, &st))
+		{
+			g_free(entry.path);
+			continue;
+		}
+		entry.mtime = st.st_mtime;
+		entry.size = st.st_size;
+		total += entry.size;
+		g_array_append_val(entries, entry);
+	}
+	g_dir_close(dir);
+	g_free(path);
+
+	g_array_sort(entries, cache_entry_compare);
+	for (k = 0; k < entries->len; k++)
+	{
+		SCacheEntry *e = &g_array_index(entries, SCacheEntry, k);
+		if (total > CACHE_MAX_SIZE && !g_remove(e->path))
+			total -= e->size;
+		g_free(e->path);
+	}
+	g_array_free(entries, TRUE);
+}
+
+/* Fills psf and weights from the entry of key. Returns FALSE, with
+ * nothing created, when there is none or it does not match. */
+gboolean cache_load(const SCacheKey* key, psf_t* psf, weights_t* weights)
+{
+	GMappedFile *file;
+	const SCacheHeader *header;
+	const gdouble *data;
+	convmask_t factor;
+	gchar *path;
+	gboolean is_loaded;
+	guint k;
+
+	path = cache_path(key);
+	file = g_mapped_file_new(path, FALSE, NULL);
+	if (!file)
+	{
+		g_free(path);
+		return FALSE;
+	}
+	header = (const SCacheHeader*)g_mapped_file_get_contents(file);
+	is_loaded = cache_header_valid(header, key, g_mapped_file_get_length(file));
+	if (is_loaded)
+	{
+		data = (const gdouble*)(header + 1);
+		psf_create(psf);
+		for (k = 0; k < header->count; k++)
+		{
+			if (!convmask_create(&factor, header->radius[k]))
+			{
+				is_loaded = FALSE;
+				break;
+			}
+			memcpy(factor.coef, data, sizeof(gdouble) * factor.r21 * factor.r21);
+			data += factor.r21 * factor.r21;
+			psf_add(psf, &factor);
+		}
+		if (is_loaded)
+			is_loaded = weights_create_copy(weights, header->wradius, data, header->rxnz, header->rynz) != NULL;
+		if (!is_loaded)
+			psf_destroy(psf);
+	}
+#if GLIB_CHECK_VERSION(2,22,0)
+	g_mapped_file_unref(file);
+#else
+	g_mapped_file_free(file);
+#endif
+	/* a hit makes the entry the most recently used */
+	if (is_loaded)
+		g_utime(path, NULL);
+	g_free(path);
+	return is_loaded;
+}
+
+/* Writes psf and weights as the entry of key, silently gives up when
+ * the cache directory cannot be written. */
+void cache_store(const SCacheKey* key, psf_t* psf, weights_t* weights)
+{
+	SCacheHeader header;
+	gchar *dir, *path, *buf, *p;
+	gsize length, n;
+	gint k;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.count = psf->count;
+	header.key = *key;
+	for (k = 0; k < psf->count; k++)
+		header.radius[k] = psf->factor[k].radius;
+	header.wradius = weights->r2 / 2;
+	header.rxnz = weights->rxnz;
+	header.rynz = weights->rynz;
+	length = sizeof(header) + sizeof(gdouble) * cache_count(&header);
+	if (length > CACHE_MAX_SIZE)
+		return;
+
+	dir = cache_dir();
+	if (g_mkdir_with_parents(dir, 0700))
+	{
+		g_free(dir);
+		return;
+	}
+	g_free(dir);
+	if (!(buf = g_try_malloc(length)))
+		return;
+	memcpy(buf, &header, sizeof(header));
+	p = buf + sizeof(header);
+	for (k = 0; k < psf->count; k++)
+	{
+		n = sizeof(gdouble) * psf->factor[k].r21 * psf->factor[k].r21;
+		memcpy(p, psf->factor[k].coef, n);
+		p += n;
+	}
+	memcpy(p, weights->w, sizeof(gdouble) * weights->size * weights->size);
+	/* written to a temporary file and renamed, readers never see half */
+	path = cache_path(key);
+	if (g_file_set_contents(path, buf, length, NULL))
+		cache_evict();
+	g_free(path);
+	g_free(buf);
+}
@@ -0,0 +1,46 @@
+/*
+ * Written 2003 Lukas Kunc <Lukas.Kunc@seznam.cz>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <glib.h>
+#include "psf.h"
+#include "weights.h"
+
+/* stamp of the file layout and of the masks written into it, raise it
+ * whenever blur or weights build them differently */
+#define CACHE_VERSION 3
+/* bytes the cache directory may hold, the least recently used entries
+ * are removed first */
+#define CACHE_MAX_SIZE (64 << 20)
+
+/* Parameters the blur and its weights are built from. */
+typedef struct
+{
+	gdouble        radius;
+	gdouble        gauss;
+	gdouble        motion;
+	gdouble        mot_angle;
+	gdouble        scale;
+} SCacheKey;
+
+gboolean cache_load(const SCacheKey* key, psf_t* psf, weights_t* weights);
+void cache_store(const SCacheKey* key, psf_t* psf, weights_t* weights);
+
+#endif
@@ -26,12 +26,18 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "compiler.h"
 #include "hopfield.h"
 #include "image.h"
 #include "lambda.h"
 #include "blur.h"
+#include "psf.h"
+#include "cache.h"
 #include "gettext.h"
 
 #define _(String) gettext (String)
@@ -46,6 +52,15 @@
 #define LAMBDAMIN_USABLE_MAX	0.999
 #define LAMBDA_MAX		10000.0
 
+#define CONV_ENERGY_MAX		1.0
+#define CONV_CHANGED_MAX	100.0
+#define CONV_DELTA_MAX		255.0
+
+#define PYRAMID_ITERATIONS	0.3	/* iterations at every coarse level per requested one */
+#define PYRAMID_LEVELS_MAX	4.0
+#define PYRAMID_LAMBDA		0.25	/* lambda relative to the finer level */
+#define PYRAMID_MIN_SIZE	32	/* no level gets smaller than this */
+
 #define RESPONSE_PREVIEW	1
 #define RESPONSE_RESET		2
 
@@ -56,6 +71,15 @@ enum
 	BOUNDARY_LAST
 };
 
+enum
+{
+	CONVERGENCE_NONE = 0,
+	CONVERGENCE_STABLE,
+	CONVERGENCE_ENERGY,
+	CONVERGENCE_CHANGED,
+	CONVERGENCE_DELTA
+};
+
 /*
 * FORWARD DECLARATIONS
 */
@@ -77,7 +101,7 @@ static void input_parameters_init();
 static void input_parameters_destroy();
 static void input_parameters_load();
 static void input_parameters_save();
-static void input_parameters_fetch_params(const GimpParam *param);
+static void input_parameters_fetch_params(gint nparams, const GimpParam *param);
 static void input_parameters_fetch_dlg();
 static void image_parameters_init(const GimpParam *param);
 static void image_parameters_destroy();
@@ -141,6 +165,13 @@ typedef struct
 	guint          boundary;
 	guint          adaptive_smooth;
 	guint          prev_iter;
+	guint          threads;
+	gdouble        conv_energy;
+	gdouble        conv_changed;
+	guint          conv_delta;
+	guint          seed;
+	guint          levels;
+	gdouble        truncation;
 } SInputParameters;
 
 typedef struct
@@ -167,6 +198,10 @@ typedef struct
 	GtkAdjustment *winsize;
 	GtkAdjustment *iterations;
 	GtkAdjustment *prev_iter;
+	GtkAdjustment *conv_energy;
+	GtkAdjustment *conv_changed;
+	GtkAdjustment *conv_delta;
+	GtkAdjustment *levels;
 	GtkAdjustment *hscroll;
 	GtkAdjustment *vscroll;
 	gboolean       frun;
@@ -184,6 +219,32 @@ typedef struct
 	GtkWidget* dialog;
 } SDialogElements;
 
+/* What compute keeps for the next call, previews and the final run,
+* as long as the parameters it was built from stay the same. */
+typedef struct
+{
+	SCacheKey      key;            /* blur of the weights and the networks */
+	guint          boundary;
+	gdouble        truncation;     /* of the weights of the networks */
+	gboolean       is_blur;        /* blur and weights built */
+	gboolean       is_nets;        /* networks created, with their thresholds and coarse levels */
+	gboolean       is_lambdafld;   /* filter and lambda fields created */
+	gboolean       is_calculated;  /* lambda fields of the observed image */
+	gdouble        lambda_min;
+	guint          winsize;
+	guint          lambda_boundary;
+} SSession;
+
+/* A coarse level of the pyramid of one channel, kept by the session
+* with the networks it starts. */
+typedef struct SLevel
+{
+	image_t        image;    /* the observed image shrunk, then its restoration */
+	psf_t          blur;
+	hopfield_t     net;
+	struct SLevel *coarser;  /* NULL until built */
+} SLevel;
+
 typedef struct
 {
 	image_t imageR;
@@ -192,11 +253,14 @@ typedef struct
 	hopfield_t hopfieldR;
 	hopfield_t hopfieldG;
 	hopfield_t hopfieldB;
-	convmask_t blur;
+	psf_t blur;
+	weights_t weights;   /* of blur, shared by the channels */
 	convmask_t filter;
 	lambda_t lambdafldR;
 	lambda_t lambdafldG;
 	lambda_t lambdafldB;
+	SLevel *pyramid[3];  /* of the channels, NULL until built */
+	SSession session;
 } SHopfield;
 
 
@@ -212,6 +276,43 @@ static SPreview           preview;
 static SHopfield          hopfield;
 static SListbox           boundary_listbox[BOUNDARY_LAST + 1];
 
+static const gchar       *convergence_text[] =
+{
+	N_("iteration limit"),
+	N_("no pixel changed"),
+	N_("energy change below limit"),
+	N_("changed pixels below limit"),
+	N_("pixel change below limit")
+};
+
+static GimpParamDef       args[] =
+{
+	{ GIMP_PDB_INT32,	 "run_mode",	"Interactive, non-interactive" },
+	{ GIMP_PDB_IMAGE,	 "image",	"Input image" },
+	{ GIMP_PDB_DRAWABLE,	 "drawable",	"Input drawable" },
+	{ GIMP_PDB_FLOAT,	 "radius",	"Blur radius (default = 6.0)" },
+	{ GIMP_PDB_FLOAT,	 "gauss",	"Gaussian blur variance (default = 0.0)" },
+	{ GIMP_PDB_FLOAT,	 "motion",	"Motion size (default = 0.0)" },
+	{ GIMP_PDB_FLOAT,	 "mot_angle",	"Motion angle (default = 0.0)" },
+	{ GIMP_PDB_FLOAT,	 "lambda",	"Noise reduction (default = 100.0)" },
+	{ GIMP_PDB_INT32,	 "boundary",	"Boundary conditions (default = mirror / 0)" },
+	{ GIMP_PDB_FLOAT,	 "lambda_min",	"Area smoothnes (default = 30.0)" },
+	{ GIMP_PDB_INT32,	 "adaptive_smooth",	"Adaptive smoothing (default = TRUE)" },
+	{ GIMP_PDB_INT32,	 "winsize",	"Smooth area size (default = 3)" },
+	{ GIMP_PDB_INT32,	 "iterations",	"Number of iterations (default = 100)" },
+	{ GIMP_PDB_INT32,	 "prev_iter",	"Number of iterations for preview (default = 10)" },
+	/* optional parameters, may be left out by the caller */
+	{ GIMP_PDB_INT32,	 "threads",	"Number of threads, 0 = all processors (default = 0)" },
+	{ GIMP_PDB_FLOAT,	 "conv_energy",	"Stop a channel when its energy change falls below this fraction of the first one, 0 = off (default = 0.0)" },
+	{ GIMP_PDB_FLOAT,	 "conv_changed",	"Stop a channel when less than this percentage of pixels changes, 0 = off (default = 0.0)" },
+	{ GIMP_PDB_INT32,	 "conv_delta",	"Stop a channel when no pixel changes by more than this, 0 = off (default = 0)" },
+	{ GIMP_PDB_INT32,	 "seed",	"Seed of the random steps, same seed gives the same result (default = 0)" },
+	{ GIMP_PDB_INT32,	 "levels",	"Levels of half size solved first to start from, 0 = off (default = 0)" },
+	{ GIMP_PDB_FLOAT,	 "truncation",	"Fraction of the sum of squares of the weights dropped with their outer rings, the blur stays exact, 0 = exact (default = 0.0)" },
+};
+static const gint nargs = sizeof (args) / sizeof (args[0]);
+#define NARGS_REQUIRED 14
+
 /*
 * CALLBACKS
 */
@@ -341,24 +442,6 @@ static void query ()
 	gchar *help_path = NULL;
 	gchar *help_uri = NULL;
 
-	static GimpParamDef	args[] =
-	{
-		{ GIMP_PDB_INT32,	 "run_mode",	"Interactive, non-interactive" },
-		{ GIMP_PDB_IMAGE,	 "image",	"Input image" },
-		{ GIMP_PDB_DRAWABLE,	 "drawable",	"Input drawable" },
-		{ GIMP_PDB_FLOAT,	 "radius",	"Blur radius (default = 6.0)" },
-		{ GIMP_PDB_FLOAT,	 "gauss",	"Gaussian blur variance (default = 0.0)" },
-		{ GIMP_PDB_FLOAT,	 "motion",	"Motion size (default = 0.0)" },
-		{ GIMP_PDB_FLOAT,	 "mot_angle",	"Motion angle (default = 0.0)" },
-		{ GIMP_PDB_FLOAT,	 "lambda",	"Noise reduction (default = 100.0)" },
-		{ GIMP_PDB_INT32,	 "boundary",	"Boundary conditions (default = mirror / 0)" },
-		{ GIMP_PDB_FLOAT,	 "lambda_min",	"Area smoothnes (default = 30.0)" },
-		{ GIMP_PDB_INT32,	 "adaptive_smooth",	"Adaptive smoothing (default = TRUE)" },
-		{ GIMP_PDB_INT32,	 "winsize",	"Smooth area size (default = 3)" },
-		{ GIMP_PDB_INT32,	 "iterations",	"Number of iterations (default = 100)" },
-		{ GIMP_PDB_INT32,	 "prev_iter",	"Number of iterations for preview (default = 10)" },
-	};
-	static gint nargs = sizeof (args) / sizeof (args[0]);
 
 
 #ifdef HAVE_SETLOCALE
@@ -408,6 +491,13 @@ static void input_parameters_init()
 	input_parameters.prev_iter = 10;
 	input_parameters.boundary = BOUNDARY_MIRROR;
 	input_parameters.adaptive_smooth = TRUE;
+	input_parameters.threads = 0;
+	input_parameters.conv_energy = 0.0;
+	input_parameters.conv_changed = 0.0;
+	input_parameters.conv_delta = 0;
+	input_parameters.seed = 0;
+	input_parameters.levels = 0;
+	input_parameters.truncation = 0.0;
 }
 
 static void input_parameters_load()
@@ -420,7 +510,7 @@ static void input_parameters_save()
 	gimp_set_data (PACKAGE_NAME, &input_parameters, sizeof (input_parameters));
 }
 
-static void input_parameters_fetch_params(const GimpParam *param)
+static void input_parameters_fetch_params(gint nparams, const GimpParam *param)
 {
 	input_parameters.radius          = param[3].data.d_float;
 	input_parameters.gauss           = param[4].data.d_float;
@@ -433,6 +523,20 @@ static void input_parameters_fetch_params(const GimpParam *param)
 	input_parameters.winsize         = param[11].data.d_int32;
 	input_parameters.iterations      = param[12].data.d_int32;
 	input_parameters.prev_iter       = param[13].data.d_int32;
+	if (nparams > 14)
+		input_parameters.threads = param[14].data.d_int32;
+	if (nparams > 15)
+		input_parameters.conv_energy = param[15].data.d_float;
+	if (nparams > 16)
+		input_parameters.conv_changed = param[16].data.d_float;
+	if (nparams > 17)
+		input_parameters.conv_delta = param[17].data.d_int32;
+	if (nparams > 18)
+		input_parameters.seed = param[18].data.d_int32;
+	if (nparams > 19)
+		input_parameters.levels = param[19].data.d_int32;
+	if (nparams > 20)
+		input_parameters.truncation = param[20].data.d_float;
 }
 
 static void input_parameters_fetch_dlg()
@@ -446,6 +550,10 @@ static void input_parameters_fetch_dlg()
 	input_parameters.winsize         = (guint) dialog_parameters.winsize->value;
 	input_parameters.iterations      = (guint) dialog_parameters.iterations->value;
 	input_parameters.prev_iter       = (guint) dialog_parameters.prev_iter->value;
+	input_parameters.conv_energy     = dialog_parameters.conv_energy->value;
+	input_parameters.conv_changed    = dialog_parameters.conv_changed->value;
+	input_parameters.conv_delta      = (guint) dialog_parameters.conv_delta->value;
+	input_parameters.levels          = (guint) dialog_parameters.levels->value;
 	/* no action for boundary - updated automaticaly */
 	input_parameters.adaptive_smooth = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON (dialog_elements.adaptive));
 }
@@ -461,6 +569,10 @@ static void dialog_parameters_init()
 	gtk_adjustment_set_value(dialog_parameters.winsize,    (gfloat)input_parameters.winsize);
 	gtk_adjustment_set_value(dialog_parameters.iterations, (gfloat)input_parameters.iterations);
 	gtk_adjustment_set_value(dialog_parameters.prev_iter,  (gfloat)input_parameters.prev_iter);
+	gtk_adjustment_set_value(dialog_parameters.conv_energy, (gfloat)input_parameters.conv_energy);
+	gtk_adjustment_set_value(dialog_parameters.conv_changed, (gfloat)input_parameters.conv_changed);
+	gtk_adjustment_set_value(dialog_parameters.conv_delta, (gfloat)input_parameters.conv_delta);
+	gtk_adjustment_set_value(dialog_parameters.levels,     (gfloat)input_parameters.levels);
 	dialog_parameters.area_smooth_enabled = TRUE;
 }
 
@@ -478,6 +590,10 @@ static void dialog_parameters_create()
 	dialog_parameters.winsize    = GTK_ADJUSTMENT (gtk_adjustment_new ((gfloat)input_parameters.winsize, 1.0f, 16.0f, 1.0f, 1.0f, 0.0f));
 	dialog_parameters.iterations = GTK_ADJUSTMENT (gtk_adjustment_new ((gfloat)input_parameters.iterations, 1.0f, 200.0f, 1.0f, 10.0f, 0.0f));
 	dialog_parameters.prev_iter  = GTK_ADJUSTMENT (gtk_adjustment_new ((gfloat)input_parameters.prev_iter, 1.0f, 20.0f, 1.0f, 1.0f, 0.0f));
+	dialog_parameters.conv_energy  = GTK_ADJUSTMENT (gtk_adjustment_new ((gfloat)input_parameters.conv_energy, 0.0f, (gfloat)CONV_ENERGY_MAX, 0.0001f, 0.001f, 0.0f));
+	dialog_parameters.conv_changed = GTK_ADJUSTMENT (gtk_adjustment_new ((gfloat)input_parameters.conv_changed, 0.0f, (gfloat)CONV_CHANGED_MAX, 0.01f, 0.1f, 0.0f));
+	dialog_parameters.conv_delta   = GTK_ADJUSTMENT (gtk_adjustment_new ((gfloat)input_parameters.conv_delta, 0.0f, (gfloat)CONV_DELTA_MAX, 1.0f, 1.0f, 0.0f));
+	dialog_parameters.levels       = GTK_ADJUSTMENT (gtk_adjustment_new ((gfloat)input_parameters.levels, 0.0f, (gfloat)PYRAMID_LEVELS_MAX, 1.0f, 1.0f, 0.0f));
 	dialog_parameters.hscroll    = GTK_ADJUSTMENT (gtk_adjustment_new (0.0f, 0.0f, (gfloat)image_parameters.sel_width - 1.0f, 1.0f, (gfloat)preview.width, (gfloat)preview.width));
 	dialog_parameters.vscroll    = GTK_ADJUSTMENT (gtk_adjustment_new (0.0f, 0.0f, (gfloat)image_parameters.sel_height - 1.0f, 1.0f, (gfloat)preview.height, (gfloat)preview.height));
 
@@ -974,6 +1090,62 @@ static GtkWidget* create_area_params()
 	return frame;
 }
 
+static GtkWidget* create_convergence_params()
+{
+	GtkWidget *frame;
+	GtkWidget *table;
+	GtkWidget *element;
+
+	frame = gtk_frame_new (_("Convergence"));
+
+	table = gtk_table_new (4, 2, FALSE);
+
+	element = gtk_label_new (_("Energy change:"));
+	gtk_misc_set_alignment (GTK_MISC (element), 1.0, 0.5);
+	gtk_table_attach_defaults (GTK_TABLE (table), element, 0, 1, 0, 1);
+	gtk_widget_show (element);
+
+	element = scaler_new (dialog_parameters.conv_energy, 0.0001f, 4);
+	gtk_table_attach_defaults (GTK_TABLE (table), element, 1, 2, 0, 1);
+	gtk_widget_show (element);
+
+	element = gtk_label_new (_("Changed pixels (%):"));
+	gtk_misc_set_alignment (GTK_MISC (element), 1.0, 0.5);
+	gtk_table_attach_defaults (GTK_TABLE (table), element, 0, 1, 1, 2);
+	gtk_widget_show (element);
+
+	element = scaler_new (dialog_parameters.conv_changed, 0.01f, 2);
+	gtk_table_attach_defaults (GTK_TABLE (table), element, 1, 2, 1, 2);
+	gtk_widget_show (element);
+
+	element = gtk_label_new (_("Pixel change:"));
+	gtk_misc_set_alignment (GTK_MISC (element), 1.0, 0.5);
+	gtk_table_attach_defaults (GTK_TABLE (table), element, 0, 1, 2, 3);
+	gtk_widget_show (element);
+
+	element = scaler_new (dialog_parameters.conv_delta, 1, 0);
+	gtk_table_attach_defaults (GTK_TABLE (table), element, 1, 2, 2, 3);
+	gtk_widget_show (element);
+
+	element = gtk_label_new (_("Coarse levels:"));
+	gtk_misc_set_alignment (GTK_MISC (element), 1.0, 0.5);
+	gtk_table_attach_defaults (GTK_TABLE (table), element, 0, 1, 3, 4);
+	gtk_widget_show (element);
+
+	element = scaler_new (dialog_parameters.levels, 1, 0);
+	gtk_table_attach_defaults (GTK_TABLE (table), element, 1, 2, 3, 4);
+	gtk_widget_show (element);
+
+	gtk_container_set_border_width (GTK_CONTAINER (table), 5);
+	gtk_table_set_row_spacings (GTK_TABLE (table), 5);
+	gtk_table_set_col_spacings (GTK_TABLE (table), 5);
+	gtk_widget_show (table);
+
+	gtk_container_add (GTK_CONTAINER (frame), table);
+	gtk_widget_show (frame);
+	return frame;
+}
+
 static GtkWidget* create_controls()
 {
 	GtkWidget *vbox;
@@ -991,6 +1163,11 @@ static GtkWidget* create_controls()
 	gtk_box_pack_start(GTK_BOX (vbox), element, FALSE, FALSE, 0);
 	gtk_widget_show(element);
 
+	/* convergence params */
+	element = create_convergence_params();
+	gtk_box_pack_start(GTK_BOX (vbox), element, FALSE, FALSE, 0);
+	gtk_widget_show(element);
+
 	/* progress */
 	element = dialog_elements.progress = gtk_progress_bar_new();
 	gtk_box_pack_start(GTK_BOX (vbox), element, FALSE, FALSE, 0);
@@ -1204,6 +1381,7 @@ static void progress_bar_init()
 	if (dialog_elements.progress)
 	{
 		gtk_progress_bar_update(GTK_PROGRESS_BAR (dialog_elements.progress), 0.0);
+		gtk_progress_bar_set_text(GTK_PROGRESS_BAR (dialog_elements.progress), NULL);
 	}
 	else
 	{
@@ -1225,6 +1403,34 @@ static void progress_bar_update(gfloat fraction)
 	event_loop();
 }
 
+static void progress_bar_text(const gchar* text)
+{
+	if (dialog_elements.progress)
+	{
+		gtk_progress_bar_set_text(GTK_PROGRESS_BAR (dialog_elements.progress), text);
+	}
+	else
+	{
+		gimp_progress_set_text (text);
+	}
+}
+
+/* Why a channel should stop iterating, CONVERGENCE_NONE to go on. */
+static guint convergence_check(hopfield_t* net, gdouble energy0)
+{
+	if (net->stat.changed == 0 || hopfield_converged(net))
+		return CONVERGENCE_STABLE;
+	if (input_parameters.conv_energy > 0.0
+	  && fabs(net->stat.energy) < input_parameters.conv_energy * fabs(energy0))
+		return CONVERGENCE_ENERGY;
+	if (input_parameters.conv_changed > 0.0
+	  && 100.0 * net->stat.changed < input_parameters.conv_changed * image_parameters.size)
+		return CONVERGENCE_CHANGED;
+	if (input_parameters.conv_delta > 0 && net->stat.delta <= input_parameters.conv_delta)
+		return CONVERGENCE_DELTA;
+	return CONVERGENCE_NONE;
+}
+
 static void progress_bar_reset()
 {
 	if (dialog_elements.progress)
@@ -1237,13 +1443,281 @@ static void progress_bar_reset()
 	}
 }
 
-static void compute(int iterations)
+/* Blur of the input parameters, with the lengths multiplied by scale,
+ * kept as its factors: only the weights need the composite. */
+static void blur_create_scaled(psf_t* blur, gdouble scale)
+{
+	convmask_t defoc, gauss, motion;
+
+	psf_create(blur);
+	blur_create_defocus(&defoc, scale * input_parameters.radius);
+	blur_create_gauss(&gauss, scale * input_parameters.gauss);
+	blur_create_motion(&motion, scale * input_parameters.motion, (double)input_parameters.mot_angle);
+	psf_add(blur, &defoc);
+	psf_add(blur, &gauss);
+	psf_add(blur, &motion);
+}
+
+/* Parameters of the blur at scale. */
+static void blur_key(SCacheKey* key, gdouble scale)
+{
+	memset(key, 0, sizeof(*key));
+	key->radius = input_parameters.radius;
+	key->gauss = input_parameters.gauss;
+	key->motion = input_parameters.motion;
+	key->mot_angle = input_parameters.mot_angle;
+	key->scale = scale;
+}
+
+/* Blur at scale and the weights of its composite, loaded from the cache
+ * when the same parameters were seen before.  The blur is always
+ * created, weights->w is NULL when they could not be. */
+static gboolean blur_prepare(psf_t* blur, weights_t* weights, gdouble scale)
+{
+	SCacheKey key;
+	convmask_t composite;
+
+	blur_key(&key, scale);
+	if (cache_load(&key, blur, weights))
+		return TRUE;
+	weights->w = NULL;
+	blur_create_scaled(blur, scale);
+	if (!psf_composite(blur, &composite))
+		return FALSE;
+	if (!weights_create(weights, &composite))
+		weights->w = NULL;
+	convmask_destroy(&composite);
+	if (!weights->w)
+		return FALSE;
+	cache_store(&key, blur, weights);
+	return TRUE;
+}
+
+/* Settings shared by the networks of all channels and levels. */
+static void hopfield_setup(hopfield_t* net, gfloat lambda, gboolean is_mirror, guint seed, guint channel, guint threads, psf_t* blur)
+{
+	net->lambda = lambda;
+	hopfield_set_mirror(net, is_mirror);
+	hopfield_set_order(net, HOPFIELD_ORDER_COLOR);
+	hopfield_set_threads(net, threads);
+	hopfield_set_seed(net, seed);
+	hopfield_set_stream(net, channel);
+	hopfield_set_truncation(net, input_parameters.truncation);
+	hopfield_set_incremental(net, TRUE);
+	hopfield_set_worklist(net, TRUE);
+	hopfield_set_separable(net, TRUE);
+	hopfield_set_spectral(net, psf_radius(blur) >= HOPFIELD_SPECTRAL_RADIUS);
+}
+
+/* Replaces image by the restoration of it at half the size, blur and
+ * lambda scaled to match, itself started from the next level down. The
+ * low frequencies settle there at a fraction of the cost. A level is
+ * built once into *level and later calls only shrink the observed
+ * image into it again. */
+static void pyramid_start(SLevel** level, image_t* image, guint levels, guint iterations, gdouble scale, gfloat lambda, gboolean is_mirror, guint seed, guint channel, guint threads)
 {
+	SLevel *l;
+	image_t coarse;
+	weights_t weights;
+	gboolean is_ready;
 	int i;
+
+	if (!levels || image->x < 2 * PYRAMID_MIN_SIZE || image->y < 2 * PYRAMID_MIN_SIZE)
+		return;
+	if (!image_shrink(&coarse, image))
+		return;
+	scale *= 0.5;
+	lambda *= PYRAMID_LAMBDA;
+	l = *level;
+	if (l)
+	{
+		memcpy(l->image.data, coarse.data, sizeof(double) * coarse.x * coarse.y);
+		image_destroy(&coarse);
+		hopfield_setup(&l->net, lambda, is_mirror, seed, channel, threads, &l->blur);
+	}
+	else
+	{
+		l = g_new0(SLevel, 1);
+		l->image = coarse;
+		is_ready = blur_prepare(&l->blur, &weights, scale);
+		hopfield_setup(&l->net, lambda, is_mirror, seed, channel, threads, &l->blur);
+		/* the threshold is taken from the observed image at this level */
+		if (!is_ready || !hopfield_create_psf_weights(&l->net, &l->blur, &weights, &l->image, NULL))
+		{
+			psf_destroy(&l->blur);
+			image_destroy(&l->image);
+			g_free(l);
+			return;
+		}
+		*level = l;
+	}
+	pyramid_start(&l->coarser, &l->image, levels - 1, iterations, scale, lambda, is_mirror, seed, channel, threads);
+	hopfield_restart(&l->net);
+	for (i = 0; i < iterations; i++)
+		hopfield_iteration(&l->net);
+	image_expand(image, &l->image);
+}
+
+static void pyramid_destroy(SLevel** level)
+{
+	if (!*level)
+		return;
+	pyramid_destroy(&(*level)->coarser);
+	hopfield_destroy(&(*level)->net);
+	psf_destroy(&(*level)->blur);
+	image_destroy(&(*level)->image);
+	g_free(*level);
+	*level = NULL;
+}
+
+/* Work of one channel between two synchronisations with the dialog. */
+typedef struct
+{
+	hopfield_t *net;
+	SLevel    **pyramid;
+	lambda_t   *lambdafld;	/* recalculated before the iteration, or NULL */
+	image_t    *image;
+	gfloat      lambda;
+	gboolean    is_mirror;
+	guint       seed;
+	guint       channel;
+	guint       threads;
+	guint       levels;
+	guint       iterations;	/* at every coarse level */
+} SChannelJob;
+
+static gpointer channel_start(gpointer data)
+{
+	SChannelJob *job = (SChannelJob*)data;
+
+	pyramid_start(job->pyramid, job->image, job->levels, job->iterations, 1.0, job->lambda, job->is_mirror, job->seed, job->channel, job->threads);
+	hopfield_restart(job->net);
+	return NULL;
+}
+
+static gpointer channel_iteration(gpointer data)
+{
+	SChannelJob *job = (SChannelJob*)data;
+
+	if (job->lambdafld)
+		lambda_calculate(job->lambdafld, job->image);
+	hopfield_iteration(job->net);
+	return NULL;
+}
+
+/* Runs func on the n jobs and returns when all are done. In parallel
+ * the first job runs in this thread and the others on threads of their
+ * own; a job whose thread can not be created runs here as well. */
+static void channel_run(GThreadFunc func, SChannelJob* job, int n, gboolean is_parallel)
+{
+	GThread *thread[3];
+	int c;
+
+	for (c = 1; c < n; c++)
+	{
+		thread[c] = NULL;
+		if (is_parallel)
+		{
+#if GLIB_CHECK_VERSION(2, 32, 0)
+			thread[c] = g_thread_try_new(NULL, func, job + c, NULL);
+#else
+			if (!g_thread_supported()) g_thread_init(NULL);
+			thread[c] = g_thread_create(func, job + c, TRUE, NULL);
+#endif
+		}
+	}
+	if (n > 0)
+		func(job);
+	for (c = 1; c < n; c++)
+	{
+		if (thread[c])
+			g_thread_join(thread[c]);
+		else
+			func(job + c);
+	}
+}
+
+/* Network of one channel sharing the weights of the blur, built from
+ * the blur when there are none. */
+static hopfield_t* channel_create(hopfield_t* net, image_t* image, lambda_t* lambdafld)
+{
+	weights_t shared;
+
+	if (!hopfield.weights.w)
+		return hopfield_create_psf(net, &hopfield.blur, image, lambdafld);
+	if (!weights_share(&shared, &hopfield.weights))
+		return NULL;
+	return hopfield_create_psf_weights(net, &hopfield.blur, &shared, image, lambdafld);
+}
+
+static void session_nets_destroy()
+{
+	int c;
+
+	if (!hopfield.session.is_nets)
+		return;
+	hopfield_destroy(&hopfield.hopfieldR);
+	if (image_parameters.img_bpp >= 3)
+	{
+		hopfield_destroy(&hopfield.hopfieldG);
+		hopfield_destroy(&hopfield.hopfieldB);
+	}
+	for (c = 0; c < 3; c++)
+		pyramid_destroy(&hopfield.pyramid[c]);
+	hopfield.session.is_nets = FALSE;
+}
+
+static void session_blur_destroy()
+{
+	session_nets_destroy();
+	if (!hopfield.session.is_blur)
+		return;
+	psf_destroy(&hopfield.blur);
+	if (hopfield.weights.w)
+		weights_destroy(&hopfield.weights);
+	hopfield.session.is_blur = FALSE;
+}
+
+static void session_lambdafld_destroy()
+{
+	if (!hopfield.session.is_lambdafld)
+		return;
+	convmask_destroy(&hopfield.filter);
+	lambda_destroy(&hopfield.lambdafldR);
+	if (image_parameters.img_bpp >= 3)
+	{
+		lambda_destroy(&hopfield.lambdafldG);
+		lambda_destroy(&hopfield.lambdafldB);
+	}
+	hopfield.session.is_lambdafld = FALSE;
+	hopfield.session.is_calculated = FALSE;
+}
+
+static void session_destroy()
+{
+	session_blur_destroy();
+	session_lambdafld_destroy();
+}
+
+static void compute(int iterations)
+{
+	static const gchar *channel_name[] = { N_("Red"), N_("Green"), N_("Blue") };
+	hopfield_t *net[] = { &hopfield.hopfieldR, &hopfield.hopfieldG, &hopfield.hopfieldB };
+	lambda_t *lambdafld[] = { &hopfield.lambdafldR, &hopfield.lambdafldG, &hopfield.lambdafldB };
+	image_t *image[] = { &hopfield.imageR, &hopfield.imageG, &hopfield.imageB };
+	hopfield_t *group[3];
+	SChannelJob job[3], running[3];
+	guint stop[3];
+	gint stopped_at[3];
+	gdouble energy0[3];
+	GString *report;
+	SSession *session;
+	SCacheKey key;
+	int i, c, n, channels;
+	guint threads;
 	gfloat lambda_min, lambda;
 	gfloat step, final;
-	gboolean is_rgb, is_adaptive, is_smooth, is_mirror;
-	convmask_t defoc, gauss, motion, blur;
+	gboolean is_rgb, is_adaptive, is_smooth, is_mirror, is_parallel;
 
 	event_loop();
 
@@ -1254,6 +1728,19 @@ static void compute(int iterations)
 	is_adaptive = (input_parameters.adaptive_smooth && is_smooth);
 	is_mirror = (input_parameters.boundary == BOUNDARY_MIRROR);
 
+	channels = is_rgb ? 3 : 1;
+	threads = input_parameters.threads;
+	is_parallel = FALSE;
+#ifdef _OPENMP
+	/* channels on threads of their own, sharing the processors; the FFT
+	 * cache of the library is locked only in an OpenMP build */
+	if (channels > 1 && omp_get_num_procs() > 1)
+	{
+		is_parallel = TRUE;
+		threads = MAX((threads ? threads : (guint)omp_get_num_procs()) / channels, 1);
+	}
+#endif
+
 	/* PROGRESS BAR */
 	step = 1.0;
 	final = (gfloat)iterations;
@@ -1275,17 +1762,36 @@ static void compute(int iterations)
 	hopfield_data_load();
 	preview_update();
 
-	blur_create_defocus(&defoc, (double)input_parameters.radius);
-	blur_create_gauss(&gauss, (double)input_parameters.gauss);
-	blur_create_motion(&motion, (double)input_parameters.motion, (double)input_parameters.mot_angle);
-	convmask_convolve(&blur, &defoc, &gauss);
-	convmask_convolve(&hopfield.blur, &blur, &motion);
-	convmask_destroy(&gauss);
-	convmask_destroy(&defoc);
-	convmask_destroy(&motion);
-
-	if (is_smooth)
+	/* the blur, its weights and the thresholds of the networks are
+	 * kept while the blur and the boundary stay, e.g. for another noise
+	 * level or the final run after a preview */
+	session = &hopfield.session;
+	blur_key(&key, 1.0);
+	if (!session->is_blur || memcmp(&key, &session->key, sizeof(key)) || session->boundary != input_parameters.boundary)
 	{
+		session_blur_destroy();
+		/* the blur is created even when its weights are not */
+		session->is_blur = TRUE;
+		session->key = key;
+		session->boundary = input_parameters.boundary;
+		if (!blur_prepare(&hopfield.blur, &hopfield.weights, 1.0))
+			goto compute_err0;
+	}
+	/* the networks truncate their copies of the exact weights */
+	if (session->is_nets && session->truncation != input_parameters.truncation)
+		session_nets_destroy();
+	session->truncation = input_parameters.truncation;
+
+	if (is_smooth && session->is_lambdafld &&
+	    (session->lambda_min != lambda_min || session->winsize != input_parameters.winsize ||
+	     session->lambda_boundary != input_parameters.boundary))
+		session_lambdafld_destroy();
+	if (is_smooth && !session->is_lambdafld)
+	{
+		session->lambda_min = lambda_min;
+		session->winsize = input_parameters.winsize;
+		session->lambda_boundary = input_parameters.boundary;
+		session->is_lambdafld = TRUE;
 		blur_create_gauss(&hopfield.filter, 1.0);
 		lambda_set_mirror(&hopfield.lambdafldR, is_mirror);
 		lambda_set_nl(&hopfield.lambdafldR, TRUE);
@@ -1301,8 +1807,13 @@ static void compute(int iterations)
 		}
 	}
 
-	if (is_smooth && !is_adaptive)
+	if (is_smooth && !is_adaptive && session->is_calculated)
+	{
+		step += channels;
+	}
+	else if (is_smooth && !is_adaptive)
 	{
+		session->is_calculated = TRUE;
 		lambda_calculate(&hopfield.lambdafldR, &hopfield.imageR);
 		progress_bar_update(step++ / final);
 		if (is_rgb)
@@ -1315,97 +1826,137 @@ static void compute(int iterations)
 		}
 	}
 
-	hopfield.hopfieldR.lambda = lambda;
-	hopfield_set_mirror(&hopfield.hopfieldR, is_mirror);
-	if (is_smooth)
-	{
-		hopfield_create(&hopfield.hopfieldR, &hopfield.blur, &hopfield.imageR, &hopfield.lambdafldR);
-	}
-	else
-	{
-		hopfield_create(&hopfield.hopfieldR, &hopfield.blur, &hopfield.imageR, NULL);
-	}
-	if (is_rgb)
+	/* the adaptive iterations overwrite the fields */
+	if (is_adaptive)
+		session->is_calculated = FALSE;
+
+	for (c = 0; c < channels; c++)
 	{
-		hopfield.hopfieldG.lambda = lambda;
-		hopfield.hopfieldB.lambda = lambda;
-		hopfield_set_mirror(&hopfield.hopfieldG, is_mirror);
-		hopfield_set_mirror(&hopfield.hopfieldB, is_mirror);
-		if (is_smooth)
+		/* channels get their own random steps */
+		hopfield_setup(net[c], lambda, is_mirror, input_parameters.seed, c, threads, &hopfield.blur);
+		if (!session->is_nets)
 		{
-			hopfield_create(&hopfield.hopfieldG, &hopfield.blur, &hopfield.imageG, &hopfield.lambdafldG);
-			hopfield_create(&hopfield.hopfieldB, &hopfield.blur, &hopfield.imageB, &hopfield.lambdafldB);
+			if (!channel_create(net[c], image[c], is_smooth ? lambdafld[c] : NULL))
+			{
+				while (c--)
+					hopfield_destroy(net[c]);
+				goto compute_err0;
+			}
 		}
 		else
 		{
-			hopfield_create(&hopfield.hopfieldG, &hopfield.blur, &hopfield.imageG, NULL);
-			hopfield_create(&hopfield.hopfieldB, &hopfield.blur, &hopfield.imageB, NULL);
+			/* the observed image was loaded again, start from it */
+			hopfield_set_lambdafld(net[c], is_smooth ? lambdafld[c] : NULL);
+			hopfield_restart(net[c]);
 		}
 	}
+	session->is_nets = TRUE;
 
-	for (i = 1; i <= iterations; i++)
+	for (c = 0; c < channels; c++)
 	{
-		if (is_adaptive)
-		{
-			lambda_calculate(&hopfield.lambdafldR, &hopfield.imageR);
-
-			progress_bar_update(step++ / final);
-			if (dialog_parameters.finish) break;
+		job[c].net = net[c];
+		job[c].pyramid = &hopfield.pyramid[c];
+		job[c].lambdafld = is_adaptive ? lambdafld[c] : NULL;
+		job[c].image = image[c];
+		job[c].lambda = lambda;
+		job[c].is_mirror = is_mirror;
+		job[c].seed = input_parameters.seed;
+		job[c].channel = c;
+		job[c].threads = threads;
+		job[c].levels = input_parameters.levels;
+		/* the coarse levels take a share of the requested iterations, a
+		 * preview of a few iterations does not pay for a full start */
+		job[c].iterations = MAX((guint)(iterations * PYRAMID_ITERATIONS + 0.5), 1);
+	}
 
-			if (is_rgb)
-			{
-				lambda_calculate(&hopfield.lambdafldG, &hopfield.imageG);
+	if (input_parameters.levels)
+	{
+		channel_run(channel_start, job, channels, is_parallel);
+		preview_update();
+	}
 
-				progress_bar_update(step++ / final);
-				if (dialog_parameters.finish) break;
+	for (c = 0; c < channels; c++)
+	{
+		stop[c] = CONVERGENCE_NONE;
+		stopped_at[c] = iterations;
+		energy0[c] = 0.0;
+	}
 
-				lambda_calculate(&hopfield.lambdafldB, &hopfield.imageB);
+	for (i = 1; i <= iterations; i++)
+	{
+		n = 0;
+		for (c = 0; c < channels; c++)
+		{
+			if (stop[c]) continue;
+			if (is_parallel)
+			{
+				running[n++] = job[c];
+				continue;
+			}
+			if (is_adaptive)
+			{
+				lambda_calculate(lambdafld[c], image[c]);
 
 				progress_bar_update(step++ / final);
 				if (dialog_parameters.finish) break;
 			}
+			group[n++] = net[c];
 		}
-		hopfield_iteration(&hopfield.hopfieldR);
-
-		progress_bar_update(step++ / final);
 		if (dialog_parameters.finish) break;
 
-		if (is_rgb)
+		if (is_parallel)
 		{
-			hopfield_iteration(&hopfield.hopfieldG);
-
-			progress_bar_update(step++ / final);
-			if (dialog_parameters.finish) break;
-
-			hopfield_iteration(&hopfield.hopfieldB);
+			/* the channels still running, each on a thread of its own */
+			channel_run(channel_iteration, running, n, TRUE);
+			if (is_adaptive) step += n;
+		}
+		else
+		{
+			/* the channels still running in one sweep */
+			hopfield_iteration_group(group, n);
+		}
+		for (c = 0; c < channels; c++)
+		{
+			if (stop[c]) continue;
+			if (i == 1) energy0[c] = net[c]->stat.energy;
+			if ((stop[c] = convergence_check(net[c], energy0[c])))
+				stopped_at[c] = i;
 
 			progress_bar_update(step++ / final);
-			if (dialog_parameters.finish) break;
 		}
+		if (dialog_parameters.finish) break;
 
 		preview_update();
 
+		for (c = 0; c < channels && stop[c]; c++);
+		if (c == channels) break;
+
 		while (gtk_events_pending()) gtk_main_iteration_do(TRUE);
 		if (dialog_parameters.finish) break;
 	}
 
-	convmask_destroy(&hopfield.blur);
-	if (is_smooth)
-	{
-		convmask_destroy(&hopfield.filter);
-		lambda_destroy(&hopfield.lambdafldR);
-	}
-	hopfield_destroy(&hopfield.hopfieldR);
-	if (is_rgb)
+	if (!dialog_parameters.finish)
 	{
-		if (is_smooth)
+		report = g_string_new (NULL);
+		for (c = 0; c < channels; c++)
 		{
-			lambda_destroy(&hopfield.lambdafldG);
-			lambda_destroy(&hopfield.lambdafldB);
+			if (c) g_string_append (report, ", ");
+			g_string_append_printf (report, _("%s: %s after %d iterations"),
+				is_rgb ? _(channel_name[c]) : _("Gray"), _(convergence_text[stop[c]]), stopped_at[c]);
 		}
-		hopfield_destroy(&hopfield.hopfieldG);
-		hopfield_destroy(&hopfield.hopfieldB);
+		if (input_parameters.truncation > 0.0)
+			g_string_append_printf (report, _(", weights %dx%d"),
+				2 * hopfield.hopfieldR.weights.rxnz + 1, 2 * hopfield.hopfieldR.weights.rynz + 1);
+		progress_bar_text (report->str);
+		g_string_free (report, TRUE);
 	}
+	goto compute_done;
+
+compute_err0:
+	session_destroy();
+	progress_bar_text(_("Out of memory"));
+compute_done:
+	fft_cache_clear();
 
 	if (!dialog_parameters.finish)
 	{
@@ -1461,6 +2012,7 @@ run (const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals
 			input_parameters_load();
 			if (!dialog ())
 			{
+				session_destroy();
 				hopfield_data_destroy();
 				image_parameters_destroy();
 				input_parameters_destroy();
@@ -1472,10 +2024,10 @@ run (const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals
 
 		case GIMP_RUN_NONINTERACTIVE:
 			/*INIT_I18N();*/
-			if (nparams != 11) status = GIMP_PDB_CALLING_ERROR;
+			if (nparams < NARGS_REQUIRED || nparams > nargs) status = GIMP_PDB_CALLING_ERROR;
 			else
 			{
-				input_parameters_fetch_params(param);
+				input_parameters_fetch_params(nparams, param);
 				compute (input_parameters.iterations);
 			}
 			break;
@@ -1505,6 +2057,7 @@ run (const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals
 	/*
 	* Detach from the drawable...
 	*/
+	session_destroy();
 	hopfield_data_destroy();
 	image_parameters_destroy();
 	input_parameters_destroy();
@@ -17,11 +17,9 @@
  *
  */
 
+#include <string.h>
 #include "convmask.h"
-
-static double convmask_get_0(convmask_t* convmask, int i, int j) {
-  return ((abs(i) <= convmask->radius && abs(j) <= convmask->radius) ? convmask_get(convmask, i, j) : 0.0);
-}
+#include "dotprod.h"
 
 convmask_t* convmask_create(convmask_t* convmask, int radius) {
   convmask->radius = radius;
@@ -29,6 +27,8 @@ convmask_t* convmask_create(convmask_t* convmask, int radius) {
   radius += 1;
   convmask->r21 = radius;
   convmask->speeder = convmask->radius * (convmask->r21 + 1);
+  convmask->span = NULL;
+  convmask->nnz = 0;
   if ((convmask->coef = malloc(sizeof(double) * radius * radius)))
     return convmask;
   /* out of memory, returm NULL */
@@ -36,50 +36,41 @@ convmask_t* convmask_create(convmask_t* convmask, int radius) {
 }
 
 
+/* Every nonzero tap of c2 adds the rows of c1, shifted and scaled by
+ * it, into ct: the products of nonzero coefficients only, no bounds
+ * checks, the zeros of a thin mask stay exact. */
 convmask_t* convmask_convolve(convmask_t* ct, convmask_t* c1, convmask_t* c2) {
-  int x, y, r, r2, x0, y0;
-  double sum;
-  convmask_t ctmp;
+  int x0, y0, y, r, r1, r2;
+  int first, last;
+  double c;
+  int *span;
 
   if (!(convmask_create(ct, c1->radius + c2->radius)))
     return NULL;
-  if (!(convmask_create(&ctmp, c1->radius + c2->radius))) {
-    convmask_destroy(ct);
-    return NULL;
-  };
-
-  r = ctmp.r21 * ctmp.r21;
-  for (x = 0; x < r; x++) {
-    ctmp.coef[x] = 0.0;
-  }
-
-  r = c1->radius;
-  for (x = -r; x <= r; x++) {
-    for (y = -r; y <= r; y++) {
-      convmask_set(&ctmp, x, y, convmask_get(c1, x, y));
-    }
-  }
-
-  r = ctmp.radius;
+  memset(ct->coef, 0, sizeof(double) * ct->r21 * ct->r21);
+  r = ct->radius;
+  r1 = c1->radius;
   r2 = c2->radius;
-  for (x = -r; x <= r; x++) {
-    for (y = -r; y <= r; y++) {
-      sum = 0.0;
-      for (x0 = -r2; x0 <= r2; x0++) {
-        for (y0 = -r2; y0 <= r2; y0++) {
-          sum += convmask_get_0(&ctmp, x - x0, y - y0) * convmask_get(c2, x0, y0);
-        }
+  span = convmask_span(c1) ? c1->span : NULL;
+  for (y0 = -r2; y0 <= r2; y0++) {
+    for (x0 = -r2; x0 <= r2; x0++) {
+      if ((c = convmask_get(c2, x0, y0)) == 0.0) continue;
+      for (y = -r1; y <= r1; y++) {
+        first = span ? span[2 * (y + r1)] : -r1;
+        last = span ? span[2 * (y + r1) + 1] : r1;
+        if (first > last) continue;
+        dotprod_axpy_double(c, c1->coef + (y + r1) * c1->r21 + r1 + first,
+                            ct->coef + (y + y0 + r) * ct->r21 + r + x0 + first, last - first + 1);
       }
-      convmask_set(ct, x, y, sum);
     }
   }
-  convmask_destroy(&ctmp);
-
   return ct;
 }
 
 void convmask_destroy(convmask_t* convmask) {
   free(convmask->coef);
+  free(convmask->span);
+  convmask->span = NULL;
 }
 
 void convmask_set_circle(convmask_t* convmask, int i, int j, double value) {
@@ -104,12 +95,43 @@ convmask_t* convmask_normalize(convmask_t* convmask) {
 
 void convmask_set(convmask_t* convmask, int i, int j, double value) {
   convmask->coef[j*convmask->r21 + convmask->speeder + i] = value;
+  /* the spans of the old coefficients */
+  if (convmask->span) {
+    free(convmask->span);
+    convmask->span = NULL;
+  }
 }
 
 double convmask_get(convmask_t* convmask, int i, int j) {
   return (convmask->coef[j*convmask->r21 + convmask->speeder + i]);
 }
 
+convmask_t* convmask_span(convmask_t* convmask) {
+  int i, j, r;
+  int *span;
+
+  /* built once, then only read, e.g. by the channel threads */
+  if (convmask->span)
+    return convmask;
+  r = convmask->radius;
+  if (!(convmask->span = (int*)malloc(sizeof(int) * 2 * convmask->r21)))
+    return NULL;
+  convmask->nnz = 0;
+  for (j = -r; j <= r; j++) {
+    span = convmask->span + 2 * (j + r);
+    span[0] = r + 1;
+    span[1] = -r - 1;
+    for (i = -r; i <= r; i++) {
+      if (convmask_get(convmask, i, j) == 0.0) continue;
+      if (i < span[0]) span[0] = i;
+      span[1] = i;
+    }
+    if (span[0] <= span[1])
+      convmask->nnz += span[1] - span[0] + 1;
+  }
+  return convmask;
+}
+
 #if defined(NDEBUG)
 void convmask_print(convmask_t* convmask, FILE* file) {
   int i, j;
@@ -31,6 +31,8 @@ typedef struct {
   int     r21;
   int     speeder;
   double *coef;
+  int    *span;     /* nonzero columns of every row, see convmask_span */
+  int     nnz;
 } convmask_t;
 
 
@@ -40,6 +42,12 @@ convmask_t* convmask_normalize(convmask_t* convmask);
 convmask_t* convmask_convolve(convmask_t* ct, convmask_t* c1, convmask_t* c2);
 void convmask_set(convmask_t* convmask, int i, int j, double value);
 double convmask_get(convmask_t* convmask, int i, int j);
+/* The first and last nonzero column of every row j into span[2*(j+radius)]
+ * and the next one, the first is larger for an empty row; nnz counts the
+ * coefficients between them.  Built at the first call, convmask_set drops
+ * it again; a mask shared by threads gets it before they start.  Returns
+ * NULL when out of memory. */
+convmask_t* convmask_span(convmask_t* convmask);
 
 void convmask_set_circle(convmask_t* convmask, int i, int j, double value);
 #if defined(NDEBUG)
@@ -0,0 +1,411 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <string.h>
+#include "dotprod.h"
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DOTPROD_X86 1
+#include <immintrin.h>
+#endif
+
+typedef double (*dotprod_double_t)(const double* a, const double* b, int n);
+typedef double (*dotprod_double_u8_t)(const double* a, const unsigned char* b, int n);
+typedef float (*dotprod_float_t)(const float* a, const float* b, int n);
+typedef int (*dotprod_short_u8_t)(const short* a, const unsigned char* b, int n);
+typedef void (*dotprod_axpy_double_t)(double a, const double* x, double* y, int n);
+typedef void (*dotprod_double_u8_x3_t)(const double* a, const unsigned char* const* b, int n, double* s);
+
+static double dotprod_double_c(const double* a, const double* b, int n) {
+  double s;
+  int i;
+  s = 0.0;
+  for (i = 0; i < n; i++) s += a[i] * b[i];
+  return s;
+}
+
+static double dotprod_double_u8_c(const double* a, const unsigned char* b, int n) {
+  double s;
+  int i;
+  s = 0.0;
+  for (i = 0; i < n; i++) s += a[i] * b[i];
+  return s;
+}
+
+static float dotprod_float_c(const float* a, const float* b, int n) {
+  float s;
+  int i;
+  s = 0.0f;
+  for (i = 0; i < n; i++) s += a[i] * b[i];
+  return s;
+}
+
+static int dotprod_short_u8_c(const short* a, const unsigned char* b, int n) {
+  int s;
+  int i;
+  s = 0;
+  for (i = 0; i < n; i++) s += a[i] * b[i];
+  return s;
+}
+
+static void dotprod_axpy_double_c(double a, const double* x, double* y, int n) {
+  int i;
+  for (i = 0; i < n; i++) y[i] += a * x[i];
+}
+
+static void dotprod_double_u8_x3_c(const double* a, const unsigned char* const* b, int n, double* s) {
+  int i;
+  s[0] = s[1] = s[2] = 0.0;
+  for (i = 0; i < n; i++) {
+    s[0] += a[i] * b[0][i];
+    s[1] += a[i] * b[1][i];
+    s[2] += a[i] * b[2][i];
+  }
+}
+
+#ifdef DOTPROD_X86
+
+__attribute__((target("sse2")))
+static double dotprod_double_sse2(const double* a, const double* b, int n) {
+  __m128d s0, s1;
+  double t[2];
+  int i;
+
+  s0 = s1 = _mm_setzero_pd();
+  for (i = 0; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+  }
+  _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+  t[0] += t[1];
+  for (; i < n; i++) t[0] += a[i] * b[i];
+  return t[0];
+}
+
+/* Same sums as dotprod_double_sse2, the bytes widened on load. */
+__attribute__((target("sse2")))
+static double dotprod_double_u8_sse2(const double* a, const unsigned char* b, int n) {
+  __m128d s0, s1;
+  double t[2];
+  int i;
+
+  s0 = s1 = _mm_setzero_pd();
+  for (i = 0; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_set_pd(b[i + 1], b[i])));
+    s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_set_pd(b[i + 3], b[i + 2])));
+  }
+  _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+  t[0] += t[1];
+  for (; i < n; i++) t[0] += a[i] * b[i];
+  return t[0];
+}
+
+/* Three dotprod_double_u8_sse2 sharing the loads of a. */
+__attribute__((target("sse2")))
+static void dotprod_double_u8_x3_sse2(const double* a, const unsigned char* const* b, int n, double* s) {
+  __m128d a0, a1, s00, s01, s10, s11, s20, s21;
+  const unsigned char *b0, *b1, *b2;
+  double t[2];
+  int i;
+
+  b0 = b[0];
+  b1 = b[1];
+  b2 = b[2];
+  s00 = s01 = s10 = s11 = s20 = s21 = _mm_setzero_pd();
+  for (i = 0; i + 4 <= n; i += 4) {
+    a0 = _mm_loadu_pd(a + i);
+    a1 = _mm_loadu_pd(a + i + 2);
+    s00 = _mm_add_pd(s00, _mm_mul_pd(a0, _mm_set_pd(b0[i + 1], b0[i])));
+    s01 = _mm_add_pd(s01, _mm_mul_pd(a1, _mm_set_pd(b0[i + 3], b0[i + 2])));
+    s10 = _mm_add_pd(s10, _mm_mul_pd(a0, _mm_set_pd(b1[i + 1], b1[i])));
+    s11 = _mm_add_pd(s11, _mm_mul_pd(a1, _mm_set_pd(b1[i + 3], b1[i + 2])));
+    s20 = _mm_add_pd(s20, _mm_mul_pd(a0, _mm_set_pd(b2[i + 1], b2[i])));
+    s21 = _mm_add_pd(s21, _mm_mul_pd(a1, _mm_set_pd(b2[i + 3], b2[i + 2])));
+  }
+  _mm_storeu_pd(t, _mm_add_pd(s00, s01));
+  s[0] = t[0] + t[1];
+  _mm_storeu_pd(t, _mm_add_pd(s10, s11));
+  s[1] = t[0] + t[1];
+  _mm_storeu_pd(t, _mm_add_pd(s20, s21));
+  s[2] = t[0] + t[1];
+  for (; i < n; i++) {
+    s[0] += a[i] * b0[i];
+    s[1] += a[i] * b1[i];
+    s[2] += a[i] * b2[i];
+  }
+}
+
+__attribute__((target("sse2")))
+static float dotprod_float_sse2(const float* a, const float* b, int n) {
+  __m128 s0, s1;
+  float t[4];
+  int i;
+
+  s0 = s1 = _mm_setzero_ps();
+  for (i = 0; i + 8 <= n; i += 8) {
+    s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+  _mm_storeu_ps(t, _mm_add_ps(s0, s1));
+  t[0] += t[1] + t[2] + t[3];
+  for (; i < n; i++) t[0] += a[i] * b[i];
+  return t[0];
+}
+
+__attribute__((target("sse2")))
+static int dotprod_short_u8_sse2(const short* a, const unsigned char* b, int n) {
+  __m128i s, z;
+  int t[4];
+  int i;
+
+  s = z = _mm_setzero_si128();
+  for (i = 0; i + 8 <= n; i += 8)
+    s = _mm_add_epi32(s, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(a + i)),
+                                        _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(b + i)), z)));
+  _mm_storeu_si128((__m128i*)t, s);
+  t[0] += t[1] + t[2] + t[3];
+  for (; i < n; i++) t[0] += a[i] * b[i];
+  return t[0];
+}
+
+__attribute__((target("sse2")))
+static void dotprod_axpy_double_sse2(double a, const double* x, double* y, int n) {
+  __m128d va;
+  int i;
+
+  va = _mm_set1_pd(a);
+  for (i = 0; i + 2 <= n; i += 2)
+    _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(va, _mm_loadu_pd(x + i))));
+  for (; i < n; i++) y[i] += a * x[i];
+}
+
+__attribute__((target("avx2,fma")))
+static double dotprod_double_avx2(const double* a, const double* b, int n) {
+  __m256d s0, s1;
+  __m128d h;
+  double t;
+  int i;
+
+  s0 = s1 = _mm256_setzero_pd();
+  for (i = 0; i + 8 <= n; i += 8) {
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), s0);
+    s1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), s1);
+  }
+  if (i + 4 <= n) {
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), s0);
+    i += 4;
+  }
+  s0 = _mm256_add_pd(s0, s1);
+  h = _mm_add_pd(_mm256_castpd256_pd128(s0), _mm256_extractf128_pd(s0, 1));
+  t = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+  for (; i < n; i++) t += a[i] * b[i];
+  return t;
+}
+
+/* Four bytes at b widened to doubles. */
+__attribute__((target("avx2,fma")))
+static __m256d dotprod_load_u8(const unsigned char* b) {
+  int v;
+  memcpy(&v, b, sizeof(v));
+  return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+}
+
+/* Same sums as dotprod_double_avx2, the bytes widened on load. */
+__attribute__((target("avx2,fma")))
+static double dotprod_double_u8_avx2(const double* a, const unsigned char* b, int n) {
+  __m256d s0, s1;
+  __m128d h;
+  double t;
+  int i;
+
+  s0 = s1 = _mm256_setzero_pd();
+  for (i = 0; i + 8 <= n; i += 8) {
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), dotprod_load_u8(b + i), s0);
+    s1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), dotprod_load_u8(b + i + 4), s1);
+  }
+  if (i + 4 <= n) {
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), dotprod_load_u8(b + i), s0);
+    i += 4;
+  }
+  s0 = _mm256_add_pd(s0, s1);
+  h = _mm_add_pd(_mm256_castpd256_pd128(s0), _mm256_extractf128_pd(s0, 1));
+  t = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+  for (; i < n; i++) t += a[i] * b[i];
+  return t;
+}
+
+/* Horizontal sum of the four lanes, in the order of dotprod_double_avx2. */
+__attribute__((target("avx2,fma")))
+static double dotprod_hsum(__m256d s) {
+  __m128d h;
+
+  h = _mm_add_pd(_mm256_castpd256_pd128(s), _mm256_extractf128_pd(s, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+}
+
+/* Three dotprod_double_u8_avx2 sharing the loads of a. */
+__attribute__((target("avx2,fma")))
+static void dotprod_double_u8_x3_avx2(const double* a, const unsigned char* const* b, int n, double* s) {
+  __m256d a0, a1, s00, s01, s10, s11, s20, s21;
+  const unsigned char *b0, *b1, *b2;
+  int i;
+
+  b0 = b[0];
+  b1 = b[1];
+  b2 = b[2];
+  s00 = s01 = s10 = s11 = s20 = s21 = _mm256_setzero_pd();
+  for (i = 0; i + 8 <= n; i += 8) {
+    a0 = _mm256_loadu_pd(a + i);
+    a1 = _mm256_loadu_pd(a + i + 4);
+    s00 = _mm256_fmadd_pd(a0, dotprod_load_u8(b0 + i), s00);
+    s01 = _mm256_fmadd_pd(a1, dotprod_load_u8(b0 + i + 4), s01);
+    s10 = _mm256_fmadd_pd(a0, dotprod_load_u8(b1 + i), s10);
+    s11 = _mm256_fmadd_pd(a1, dotprod_load_u8(b1 + i + 4), s11);
+    s20 = _mm256_fmadd_pd(a0, dotprod_load_u8(b2 + i), s20);
+    s21 = _mm256_fmadd_pd(a1, dotprod_load_u8(b2 + i + 4), s21);
+  }
+  if (i + 4 <= n) {
+    a0 = _mm256_loadu_pd(a + i);
+    s00 = _mm256_fmadd_pd(a0, dotprod_load_u8(b0 + i), s00);
+    s10 = _mm256_fmadd_pd(a0, dotprod_load_u8(b1 + i), s10);
+    s20 = _mm256_fmadd_pd(a0, dotprod_load_u8(b2 + i), s20);
+    i += 4;
+  }
+  s[0] = dotprod_hsum(_mm256_add_pd(s00, s01));
+  s[1] = dotprod_hsum(_mm256_add_pd(s10, s11));
+  s[2] = dotprod_hsum(_mm256_add_pd(s20, s21));
+  for (; i < n; i++) {
+    s[0] += a[i] * b0[i];
+    s[1] += a[i] * b1[i];
+    s[2] += a[i] * b2[i];
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static float dotprod_float_avx2(const float* a, const float* b, int n) {
+  __m256 s0, s1;
+  __m128 h;
+  float t;
+  int i;
+
+  s0 = s1 = _mm256_setzero_ps();
+  for (i = 0; i + 16 <= n; i += 16) {
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+    s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+  }
+  if (i + 8 <= n) {
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+    i += 8;
+  }
+  s0 = _mm256_add_ps(s0, s1);
+  h = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1));
+  h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+  t = _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1)));
+  for (; i < n; i++) t += a[i] * b[i];
+  return t;
+}
+
+__attribute__((target("avx2,fma")))
+static int dotprod_short_u8_avx2(const short* a, const unsigned char* b, int n) {
+  __m256i s;
+  __m128i h;
+  int t;
+  int i;
+
+  s = _mm256_setzero_si256();
+  for (i = 0; i + 16 <= n; i += 16)
+    s = _mm256_add_epi32(s, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                              _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + i)))));
+  h = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+  if (i + 8 <= n) {
+    h = _mm_add_epi32(h, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(a + i)),
+                                        _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(b + i)))));
+    i += 8;
+  }
+  h = _mm_add_epi32(h, _mm_unpackhi_epi64(h, h));
+  h = _mm_add_epi32(h, _mm_shuffle_epi32(h, 1));
+  t = _mm_cvtsi128_si32(h);
+  for (; i < n; i++) t += a[i] * b[i];
+  return t;
+}
+
+__attribute__((target("avx2,fma")))
+static void dotprod_axpy_double_avx2(double a, const double* x, double* y, int n) {
+  __m256d va;
+  int i;
+
+  va = _mm256_set1_pd(a);
+  for (i = 0; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(y + i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+  for (; i < n; i++) y[i] += a * x[i];
+}
+
+#endif
+
+static dotprod_double_t dotprod_double_impl = dotprod_double_c;
+static dotprod_double_u8_t dotprod_double_u8_impl = dotprod_double_u8_c;
+static dotprod_float_t dotprod_float_impl = dotprod_float_c;
+static dotprod_short_u8_t dotprod_short_u8_impl = dotprod_short_u8_c;
+static dotprod_axpy_double_t dotprod_axpy_double_impl = dotprod_axpy_double_c;
+static dotprod_double_u8_x3_t dotprod_double_u8_x3_impl = dotprod_double_u8_x3_c;
+
+#ifdef DOTPROD_X86
+/* Picks the kernels once at load time, before any thread can call them. */
+__attribute__((constructor))
+static void dotprod_resolve(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    dotprod_double_impl = dotprod_double_avx2;
+    dotprod_double_u8_impl = dotprod_double_u8_avx2;
+    dotprod_float_impl = dotprod_float_avx2;
+    dotprod_short_u8_impl = dotprod_short_u8_avx2;
+    dotprod_axpy_double_impl = dotprod_axpy_double_avx2;
+    dotprod_double_u8_x3_impl = dotprod_double_u8_x3_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    dotprod_double_impl = dotprod_double_sse2;
+    dotprod_double_u8_impl = dotprod_double_u8_sse2;
+    dotprod_float_impl = dotprod_float_sse2;
+    dotprod_short_u8_impl = dotprod_short_u8_sse2;
+    dotprod_axpy_double_impl = dotprod_axpy_double_sse2;
+    dotprod_double_u8_x3_impl = dotprod_double_u8_x3_sse2;
+  }
+}
+#endif
+
+double dotprod_double(const double* a, const double* b, int n) {
+  return dotprod_double_impl(a, b, n);
+}
+
+double dotprod_double_u8(const double* a, const unsigned char* b, int n) {
+  return dotprod_double_u8_impl(a, b, n);
+}
+
+float dotprod_float(const float* a, const float* b, int n) {
+  return dotprod_float_impl(a, b, n);
+}
+
+int dotprod_short_u8(const short* a, const unsigned char* b, int n) {
+  return dotprod_short_u8_impl(a, b, n);
+}
+
+void dotprod_axpy_double(double a, const double* x, double* y, int n) {
+  dotprod_axpy_double_impl(a, x, y, n);
+}
+
+void dotprod_double_u8_x3(const double* a, const unsigned char* const* b, int n, double* s) {
+  dotprod_double_u8_x3_impl(a, b, n, s);
+}
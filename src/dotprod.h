@@ -0,0 +1,45 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef _DOTPROD_H
+#define _DOTPROD_H
+
+#include "compiler.h"
+
+C_DECL_BEGIN
+
+/* Dot product of two contiguous vectors of length n.  On x86 the AVX2/FMA
+ * or SSE2 kernel is picked when the program is loaded, elsewhere plain C
+ * is used. */
+double dotprod_double(const double* a, const double* b, int n);
+/* As dotprod_double with b a byte plane, the sum is the same. */
+double dotprod_double_u8(const double* a, const unsigned char* b, int n);
+/* As dotprod_double in single precision, the SIMD kernels sum in a
+ * different order than plain C. */
+float dotprod_float(const float* a, const float* b, int n);
+/* Integer dot product of weights and a byte plane, the caller keeps the
+ * sum within int. */
+int dotprod_short_u8(const short* a, const unsigned char* b, int n);
+/* dotprod_double_u8 of a with b[0], b[1] and b[2] into s[0..2], a is
+ * loaded once for the three; every sum is the same as the single one. */
+void dotprod_double_u8_x3(const double* a, const unsigned char* const* b, int n, double* s);
+/* y += a * x for contiguous vectors of length n. */
+void dotprod_axpy_double(double a, const double* x, double* y, int n);
+
+C_DECL_END
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "fft.h"
+
+/* Smallest length >= n that fft_create accepts. */
+int fft_size(int n) {
+  int m;
+
+  for (;; n++) {
+    m = n;
+    while (m % 2 == 0) m /= 2;
+    while (m % 3 == 0) m /= 3;
+    while (m % 5 == 0) m /= 5;
+    if (m == 1) return n;
+  }
+}
+
+static fft_plan_t* fft_plan_create(fft_plan_t* plan, int n) {
+  int k, p, m;
+  double a;
+
+  plan->n = n;
+  if (!(plan->twiddle = (fft_complex_t*)malloc(sizeof(fft_complex_t) * n)))
+    return NULL;
+  for (k = 0; k < n; k++) {
+    a = -2.0 * M_PI * k / n;
+    plan->twiddle[k].re = cos(a);
+    plan->twiddle[k].im = sin(a);
+  }
+  /* radix 4 first, 3 and 5 go through the generic butterfly */
+  k = 0;
+  m = n;
+  while (m > 1) {
+    if (m % 4 == 0) p = 4;
+    else if (m % 2 == 0) p = 2;
+    else if (m % 3 == 0) p = 3;
+    else p = 5;
+    m /= p;
+    plan->factors[k++] = p;
+    plan->factors[k++] = m;
+  }
+  return plan;
+}
+
+static void fft_plan_destroy(fft_plan_t* plan) {
+  free(plan->twiddle);
+  plan->twiddle = NULL;
+}
+
+static void fft_butterfly2(fft_plan_t* plan, fft_complex_t* out, int fstride, int m) {
+  fft_complex_t t, w;
+  int u;
+
+  for (u = 0; u < m; u++) {
+    w = plan->twiddle[u * fstride];
+    t.re = out[u + m].re * w.re - out[u + m].im * w.im;
+    t.im = out[u + m].re * w.im + out[u + m].im * w.re;
+    out[u + m].re = out[u].re - t.re;
+    out[u + m].im = out[u].im - t.im;
+    out[u].re += t.re;
+    out[u].im += t.im;
+  }
+}
+
+static void fft_butterfly4(fft_plan_t* plan, fft_complex_t* out, int fstride, int m) {
+  fft_complex_t s[4], w, t3, t4, t5;
+  int u, q;
+
+  for (u = 0; u < m; u++) {
+    s[0] = out[u];
+    for (q = 1; q < 4; q++) {
+      w = plan->twiddle[q * u * fstride];
+      s[q].re = out[u + q * m].re * w.re - out[u + q * m].im * w.im;
+      s[q].im = out[u + q * m].re * w.im + out[u + q * m].im * w.re;
+    }
+    t5.re = s[0].re - s[2].re;
+    t5.im = s[0].im - s[2].im;
+    s[0].re += s[2].re;
+    s[0].im += s[2].im;
+    t3.re = s[1].re + s[3].re;
+    t3.im = s[1].im + s[3].im;
+    t4.re = s[1].re - s[3].re;
+    t4.im = s[1].im - s[3].im;
+    out[u].re = s[0].re + t3.re;
+    out[u].im = s[0].im + t3.im;
+    out[u + 2 * m].re = s[0].re - t3.re;
+    out[u + 2 * m].im = s[0].im - t3.im;
+    out[u + m].re = t5.re + t4.im;
+    out[u + m].im = t5.im - t4.re;
+    out[u + 3 * m].re = t5.re - t4.im;
+    out[u + 3 * m].im = t5.im + t4.re;
+  }
+}
+
+/* Combine p transforms of length m at out, m apart, into one of p*m. */
+static void fft_butterfly(fft_plan_t* plan, fft_complex_t* out, int fstride, int m, int p) {
+  fft_complex_t scratch[5], t, w;
+  int u, q, q1, k, tw;
+
+  for (u = 0; u < m; u++) {
+    for (q = 0; q < p; q++)
+      scratch[q] = out[u + q * m];
+    for (q1 = 0, k = u; q1 < p; q1++, k += m) {
+      t = scratch[0];
+      tw = 0;
+      for (q = 1; q < p; q++) {
+        tw += fstride * k;
+        if (tw >= plan->n) tw -= plan->n;
+        w = plan->twiddle[tw];
+        t.re += scratch[q].re * w.re - scratch[q].im * w.im;
+        t.im += scratch[q].re * w.im + scratch[q].im * w.re;
+      }
+      out[k] = t;
+    }
+  }
+}
+
+/* Mixed radix decimation in time, in is read fstride * step apart. */
+static void fft_work(fft_plan_t* plan, fft_complex_t* out, const fft_complex_t* in, int fstride, int step, const int* factors) {
+  int p, m, k;
+
+  p = factors[0];
+  m = factors[1];
+  if (m == 1) {
+    for (k = 0; k < p; k++)
+      out[k] = in[k * fstride * step];
+  } else {
+    for (k = 0; k < p; k++)
+      fft_work(plan, out + k * m, in + k * fstride * step, fstride * p, step, factors + 2);
+  }
+  if (p == 4) fft_butterfly4(plan, out, fstride, m);
+  else if (p == 2) fft_butterfly2(plan, out, fstride, m);
+  else fft_butterfly(plan, out, fstride, m, p);
+}
+
+/* Forward transform of n values step apart from in to contiguous out. */
+static void fft_line(fft_plan_t* plan, fft_complex_t* out, const fft_complex_t* in, int step) {
+  if (plan->n == 1) *out = *in;
+  else fft_work(plan, out, in, 1, step, plan->factors);
+}
+
+void fft_init(fft_t* fft) {
+  fft->planx.twiddle = fft->plany.twiddle = NULL;
+  fft->tmp = fft->data = NULL;
+}
+
+fft_t* fft_create(fft_t* fft, int x, int y) {
+  fft_init(fft);
+  fft->x = x;
+  fft->y = y;
+  if (!(fft->data = (fft_complex_t*)malloc(sizeof(fft_complex_t) * x * y)))
+    return NULL;
+  if (!fft_plan_create(&(fft->planx), x) || !fft_plan_create(&(fft->plany), y) ||
+      !(fft->tmp = (fft_complex_t*)malloc(sizeof(fft_complex_t) * (x > y ? x : y)))) {
+    fft_destroy(fft);
+    return NULL;
+  }
+  return fft;
+}
+
+void fft_destroy(fft_t* fft) {
+  fft_plan_destroy(&(fft->planx));
+  fft_plan_destroy(&(fft->plany));
+  free(fft->tmp);
+  free(fft->data);
+  fft_init(fft);
+}
+
+void fft_forward(fft_t* fft) {
+  int i, j;
+  fft_complex_t *row;
+
+  for (j = 0; j < fft->y; j++) {
+    row = fft->data + j * fft->x;
+    for (i = 0; i < fft->x; i++)
+      fft->tmp[i] = row[i];
+    fft_line(&(fft->planx), row, fft->tmp, 1);
+  }
+  for (i = 0; i < fft->x; i++) {
+    fft_line(&(fft->plany), fft->tmp, fft->data + i, fft->x);
+    for (j = 0; j < fft->y; j++)
+      fft->data[j * fft->x + i] = fft->tmp[j];
+  }
+}
+
+/* Inverse transform scaled by 1 / (x y), through the conjugates. */
+void fft_inverse(fft_t* fft) {
+  int k, n;
+  double scale;
+
+  n = fft->x * fft->y;
+  for (k = 0; k < n; k++)
+    fft->data[k].im = -fft->data[k].im;
+  fft_forward(fft);
+  scale = 1.0 / n;
+  for (k = 0; k < n; k++) {
+    fft->data[k].re *= scale;
+    fft->data[k].im *= -scale;
+  }
+}
+
+/* Transform kept between the calls of fft_convolve, with the spectrum
+ * of the last mask it was used for. */
+typedef struct {
+  int            busy;
+  fft_t          fft;
+  fft_complex_t *spectrum;
+  double        *coef;          /* copy of the mask, NULL if none */
+  int            r21;
+  int            correlate;
+} fft_cache_t;
+
+static fft_cache_t fft_cache[FFT_CACHE_SIZE];
+
+static void fft_cache_destroy(fft_cache_t* cache) {
+  fft_destroy(&(cache->fft));
+  free(cache->spectrum);
+  free(cache->coef);
+  cache->spectrum = NULL;
+  cache->coef = NULL;
+}
+
+static int fft_cache_match(fft_cache_t* cache, convmask_t* mask, int correlate) {
+  return cache->coef && cache->r21 == mask->r21 && cache->correlate == correlate &&
+    !memcmp(cache->coef, mask->coef, sizeof(double) * mask->r21 * mask->r21);
+}
+
+/* Free entry of the cache, preferably of the same size and mask. */
+static fft_cache_t* fft_cache_get(int x, int y, convmask_t* mask, int correlate) {
+  int k, score, best;
+  fft_cache_t *cache;
+
+  cache = NULL;
+  best = -1;
+#ifdef _OPENMP
+#pragma omp critical (fft_cache)
+#endif
+  {
+    for (k = 0; k < FFT_CACHE_SIZE; k++) {
+      if (fft_cache[k].busy) continue;
+      score = 0;
+      if (fft_cache[k].fft.data && fft_cache[k].fft.x == x && fft_cache[k].fft.y == y)
+        score = fft_cache_match(&fft_cache[k], mask, correlate) ? 2 : 1;
+      if (score > best) {
+        best = score;
+        cache = &fft_cache[k];
+      }
+    }
+    if (cache) cache->busy = 1;
+  }
+  return cache;
+}
+
+static void fft_cache_put(fft_cache_t* cache) {
+#ifdef _OPENMP
+#pragma omp critical (fft_cache)
+#endif
+  cache->busy = 0;
+}
+
+/* Makes the transform x times y and the spectrum that of the mask,
+ * flipped for correlate. Returns NULL when out of memory. */
+static fft_cache_t* fft_cache_prepare(fft_cache_t* cache, int x, int y, convmask_t* mask, int correlate) {
+  int i, j, k, r, n;
+
+  if (!cache->fft.data || cache->fft.x != x || cache->fft.y != y) {
+    fft_cache_destroy(cache);
+    if (!fft_create(&(cache->fft), x, y))
+      return NULL;
+    if (!(cache->spectrum = (fft_complex_t*)malloc(sizeof(fft_complex_t) * x * y))) {
+      fft_cache_destroy(cache);
+      return NULL;
+    }
+  } else if (fft_cache_match(cache, mask, correlate)) {
+    return cache;
+  }
+  n = mask->r21 * mask->r21;
+  free(cache->coef);
+  if (!(cache->coef = (double*)malloc(sizeof(double) * n))) {
+    fft_cache_destroy(cache);
+    return NULL;
+  }
+  memcpy(cache->coef, mask->coef, sizeof(double) * n);
+  cache->r21 = mask->r21;
+  cache->correlate = correlate;
+
+  /* mask wrapped around the origin */
+  r = mask->radius;
+  memset(cache->fft.data, 0, sizeof(fft_complex_t) * x * y);
+  for (j = -r; j <= r; j++) {
+    for (i = -r; i <= r; i++) {
+      k = correlate ? ((-j + y) % y) * x + (-i + x) % x : ((j + y) % y) * x + (i + x) % x;
+      cache->fft.data[k].re = convmask_get(mask, i, j);
+    }
+  }
+  fft_forward(&(cache->fft));
+  memcpy(cache->spectrum, cache->fft.data, sizeof(fft_complex_t) * x * y);
+  return cache;
+}
+
+/* Convolution of src with mask, or correlation if correlate, into the
+ * x times y plane dst. The border of src must be at least the radius of
+ * the mask; it gives the boundary condition. The upper and the lower
+ * half of the image go as the real and the imaginary part of one
+ * transform. Returns NULL when out of memory. */
+double* fft_convolve(double* dst, halo_t* src, convmask_t* mask, int correlate) {
+  int i, j, r, h, x, y, px, py;
+  fft_cache_t *cache, local;
+  fft_complex_t *d, *s, t;
+  double *row;
+
+  r = mask->radius;
+  h = (src->y + 1) / 2;
+  px = fft_size(src->x + 2*r);
+  py = fft_size(h + 2*r);
+  if (!(cache = fft_cache_get(px, py, mask, correlate))) {
+    /* all taken by other threads */
+    memset(&local, 0, sizeof(local));
+    cache = &local;
+  }
+  if (!fft_cache_prepare(cache, px, py, mask, correlate)) {
+    if (cache != &local) fft_cache_put(cache);
+    return NULL;
+  }
+
+  memset(cache->fft.data, 0, sizeof(fft_complex_t) * px * py);
+  for (j = -r; j < h + r; j++) {
+    d = cache->fft.data + (j + r) * px;
+    row = src->data + j * src->stride - r;
+    for (i = 0; i < src->x + 2*r; i++)
+      d[i].re = row[i];
+    if (h + j < src->y + r) {
+      row += h * src->stride;
+      for (i = 0; i < src->x + 2*r; i++)
+        d[i].im = row[i];
+    }
+  }
+  fft_forward(&(cache->fft));
+  d = cache->fft.data;
+  s = cache->spectrum;
+  for (i = 0; i < px * py; i++) {
+    t.re = d[i].re * s[i].re - d[i].im * s[i].im;
+    t.im = d[i].re * s[i].im + d[i].im * s[i].re;
+    d[i] = t;
+  }
+  fft_inverse(&(cache->fft));
+
+  x = src->x;
+  y = src->y;
+  for (j = 0; j < y; j++) {
+    if (j < h) {
+      d = cache->fft.data + (j + r) * px + r;
+      for (i = 0; i < x; i++)
+        dst[j * x + i] = d[i].re;
+    } else {
+      d = cache->fft.data + (j - h + r) * px + r;
+      for (i = 0; i < x; i++)
+        dst[j * x + i] = d[i].im;
+    }
+  }
+
+  if (cache == &local) fft_cache_destroy(cache);
+  else fft_cache_put(cache);
+  return dst;
+}
+
+/* Frees the transforms kept by fft_convolve. */
+void fft_cache_clear(void) {
+  int k;
+
+#ifdef _OPENMP
+#pragma omp critical (fft_cache)
+#endif
+  for (k = 0; k < FFT_CACHE_SIZE; k++)
+    if (!fft_cache[k].busy) fft_cache_destroy(&fft_cache[k]);
+}
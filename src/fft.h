@@ -0,0 +1,66 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef _FFT_H
+#define _FFT_H
+
+#include "compiler.h"
+#include "convmask.h"
+#include "halo.h"
+
+C_DECL_BEGIN
+
+/* mask radius from which fft_convolve is faster than the plain sum */
+#define FFT_CONVOLVE_RADIUS 3
+/* transforms kept by fft_convolve for the next call of the same size */
+#define FFT_CACHE_SIZE 4
+
+typedef struct {
+  double re;
+  double im;
+} fft_complex_t;
+
+/* Plan of a 1-D transform of length n, n a product of 2, 3 and 5. */
+typedef struct {
+  int            n;
+  int            factors[64];   /* radix, remaining length, ... */
+  fft_complex_t *twiddle;       /* exp(-2 pi i k / n) */
+} fft_plan_t;
+
+/* 2-D transform in place over data, x columns of y rows. */
+typedef struct {
+  int            x;
+  int            y;
+  fft_plan_t     planx;
+  fft_plan_t     plany;
+  fft_complex_t *data;
+  fft_complex_t *tmp;           /* line of max(x, y) */
+} fft_t;
+
+int fft_size(int n);
+void fft_init(fft_t* fft);
+fft_t* fft_create(fft_t* fft, int x, int y);
+void fft_destroy(fft_t* fft);
+void fft_forward(fft_t* fft);
+void fft_inverse(fft_t* fft);
+double* fft_convolve(double* dst, halo_t* src, convmask_t* mask, int correlate);
+void fft_cache_clear(void);
+
+C_DECL_END
+
+#endif
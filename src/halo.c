@@ -0,0 +1,201 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include "halo.h"
+
+/* Same as boundary_normalize_*, but also valid for borders wider than
+ * the image (the pattern is repeated). */
+static int halo_normalize(int c, int n, int mirror) {
+  int period;
+  if (mirror) {
+    if (n < 2) return 0;
+    period = 2 * (n - 1);
+    c %= period;
+    if (c < 0) c += period;
+    return (c >= n) ? period - c : c;
+  }
+  c %= n;
+  return (c < 0) ? c + n : c;
+}
+
+static int* halo_create_map(int n, int border, int mirror) {
+  int *map;
+  int c;
+  if (!(map = (int*)malloc(sizeof(int) * (n + 2*border))))
+    return NULL;
+  map += border;
+  for (c = -border; c < n + border; c++)
+    map[c] = halo_normalize(c, n, mirror);
+  return map;
+}
+
+static int halo_size(halo_t* halo) {
+  switch (halo->type) {
+    case HALO_FLOAT: return sizeof(float);
+    case HALO_BYTE: return sizeof(unsigned char);
+    default: return sizeof(double);
+  }
+}
+
+/* Store value at padded offset k. */
+static void halo_put(halo_t* halo, int k, double value) {
+  switch (halo->type) {
+    case HALO_FLOAT:
+      halo->fdata[k] = (float)value;
+      break;
+    case HALO_BYTE:
+      halo->bdata[k] = (unsigned char)(value < 0.0 ? 0 : value > 255.0 ? 255 : (int)(value + 0.5));
+      break;
+    default:
+      halo->data[k] = value;
+      break;
+  }
+}
+
+/* Copy the pixel at padded offset src to offset dst. */
+static void halo_copy(halo_t* halo, int dst, int src) {
+  switch (halo->type) {
+    case HALO_FLOAT:
+      halo->fdata[dst] = halo->fdata[src];
+      break;
+    case HALO_BYTE:
+      halo->bdata[dst] = halo->bdata[src];
+      break;
+    default:
+      halo->data[dst] = halo->data[src];
+      break;
+  }
+}
+
+/* Copy value to the padded columns of row gy which are images of x. */
+static void halo_set_row(halo_t* halo, int gy, int x, double value) {
+  int row;
+  int gx;
+
+  row = gy * halo->stride;
+  halo_put(halo, row + x, value);
+  if (x > halo->border && x < halo->x - 1 - halo->border) return;
+  for (gx = -halo->border; gx < 0; gx++)
+    if (halo->mapx[gx] == x) halo_put(halo, row + gx, value);
+  for (gx = halo->x; gx < halo->x + halo->border; gx++)
+    if (halo->mapx[gx] == x) halo_put(halo, row + gx, value);
+}
+
+void halo_init(halo_t* halo) {
+  halo->mapx = NULL;
+  halo->mapy = NULL;
+  halo->buf = NULL;
+  halo->data = NULL;
+  halo->fdata = NULL;
+  halo->bdata = NULL;
+}
+
+halo_t* halo_create(halo_t* halo, int x, int y, int border, int mirror, int type) {
+  int origin;
+
+  halo_init(halo);
+  halo->x = x;
+  halo->y = y;
+  halo->border = border;
+  halo->stride = x + 2*border;
+  halo->mirror = mirror;
+  halo->type = type;
+  if (!(halo->mapx = halo_create_map(x, border, mirror)))
+    return NULL;
+  if (!(halo->mapy = halo_create_map(y, border, mirror))) {
+    halo_destroy(halo);
+    return NULL;
+  }
+  if (!(halo->buf = malloc(halo_size(halo) * halo->stride * (y + 2*border)))) {
+    halo_destroy(halo);
+    return NULL;
+  }
+  origin = border * halo->stride + border;
+  switch (type) {
+    case HALO_FLOAT:
+      halo->fdata = (float*)halo->buf + origin;
+      break;
+    case HALO_BYTE:
+      halo->bdata = (unsigned char*)halo->buf + origin;
+      break;
+    default:
+      halo->data = (double*)halo->buf + origin;
+      break;
+  }
+  return halo;
+}
+
+void halo_destroy(halo_t* halo) {
+  if (halo->mapx) free(halo->mapx - halo->border);
+  if (halo->mapy) free(halo->mapy - halo->border);
+  free(halo->buf);
+  halo_init(halo);
+}
+
+/* Fill the border from the interior. */
+void halo_fill(halo_t* halo) {
+  int gx, gy;
+  int row, srcrow;
+
+  for (gy = 0; gy < halo->y; gy++) {
+    row = gy * halo->stride;
+    for (gx = -halo->border; gx < 0; gx++)
+      halo_copy(halo, row + gx, row + halo->mapx[gx]);
+    for (gx = halo->x; gx < halo->x + halo->border; gx++)
+      halo_copy(halo, row + gx, row + halo->mapx[gx]);
+  }
+  for (gy = -halo->border; gy < halo->y + halo->border; gy++) {
+    if (gy >= 0 && gy < halo->y) continue;
+    row = gy * halo->stride - halo->border;
+    srcrow = halo->mapy[gy] * halo->stride - halo->border;
+    for (gx = 0; gx < halo->stride; gx++)
+      halo_copy(halo, row + gx, srcrow + gx);
+  }
+}
+
+/* Load the interior from a row-major x*y plane and fill the border,
+ * a byte plane gets the values rounded and clamped to 0..255. */
+void halo_load(halo_t* halo, double* src) {
+  int gx, gy;
+
+  for (gy = 0; gy < halo->y; gy++) {
+    for (gx = 0; gx < halo->x; gx++)
+      halo_put(halo, gy * halo->stride + gx, src[gy * halo->x + gx]);
+  }
+  halo_fill(halo);
+}
+
+/* Set the interior pixel [x,y] and refresh all its ghost copies. */
+void halo_set(halo_t* halo, int x, int y, double value) {
+  int gy;
+
+  halo_set_row(halo, y, x, value);
+  if (y > halo->border && y < halo->y - 1 - halo->border) return;
+  for (gy = -halo->border; gy < 0; gy++)
+    if (halo->mapy[gy] == y) halo_set_row(halo, gy, x, value);
+  for (gy = halo->y; gy < halo->y + halo->border; gy++)
+    if (halo->mapy[gy] == y) halo_set_row(halo, gy, x, value);
+}
+
+double halo_get(halo_t* halo, int x, int y) {
+  switch (halo->type) {
+    case HALO_FLOAT: return halo->fdata[y * halo->stride + x];
+    case HALO_BYTE: return halo->bdata[y * halo->stride + x];
+    default: return halo->data[y * halo->stride + x];
+  }
+}
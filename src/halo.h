@@ -0,0 +1,60 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef _HALO_H
+#define _HALO_H
+
+#include "compiler.h"
+
+C_DECL_BEGIN
+
+/* storage of the pixels, only the matching data pointer is set */
+enum {
+  HALO_DOUBLE = 0,
+  HALO_FLOAT,
+  HALO_BYTE         /* integer values 0..255 */
+};
+
+/* Plane padded with a ghost border holding the mirror or periodical
+ * copy of the interior, so that pixels up to border away from the image
+ * can be read with a plain stride instead of boundary_normalize_*. */
+typedef struct {
+  int     x;
+  int     y;
+  int     border;
+  int     stride;
+  int     mirror;
+  int     type;
+  int    *mapx;     /* interior column of padded column, mapx[-border..x+border) */
+  int    *mapy;     /* interior row of padded row, mapy[-border..y+border) */
+  void   *buf;
+  double *data;     /* pixel [0,0] inside buf */
+  float  *fdata;
+  unsigned char *bdata;
+} halo_t;
+
+void halo_init(halo_t* halo);
+halo_t* halo_create(halo_t* halo, int x, int y, int border, int mirror, int type);
+void halo_destroy(halo_t* halo);
+void halo_fill(halo_t* halo);
+void halo_load(halo_t* halo, double* src);
+void halo_set(halo_t* halo, int x, int y, double value);
+double halo_get(halo_t* halo, int x, int y);
+
+C_DECL_END
+
+#endif
@@ -17,7 +17,13 @@
  *
  */
 
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "hopfield.h"
+#include "dotprod.h"
 
 #define hardlim(x) ((x)>=0?1:-1)
 #ifndef min
@@ -29,389 +35,1294 @@
 
 /* Private functions */
 
-static double hopfield_iteration_period(hopfield_t* hopfield) {
-  double pom;
-  int p, r;
-  int i,j;
+/* Update of pixel [i,j] in the n channels of group, stat[c] is the one
+ * of channel c. */
+typedef void (*hopfield_pixel_t)(hopfield_t** group, int n, int i, int j, hopfield_stat_t* stat);
+
+/* Window sum of the weights around their center w, rows wstride apart,
+ * and the pixels around u over the nonzero part given by sparse: the
+ * spans of the rows or, once packed, the symmetric pairs. */
+static double hopfield_window(const double* w, int wstride, weights_sparse_t* sparse, int ry, const unsigned char* u, int stride) {
+  const int *span;
   double s;
   int k;
-  int dui;
-  double dE;
-  double Sum;
-  double ddui;
-  double dk;
-  double z;
-  int x, y;
-  int value;
-  int rxnz, rynz;
+
+  if (sparse->offset) {
+    s = sparse->center * u[0];
+    for (k = 0; k < sparse->npacked; k++)
+      s += sparse->value[k] * (u[sparse->offset[k]] + u[-sparse->offset[k]]);
+    return s;
+  }
+  s = 0.0;
+  span = sparse->span;
+  for (k = -ry; k <= ry; k++, span += 2) {
+    if (span[0] <= span[1])
+      s += dotprod_double_u8(w + k * wstride + span[0], u + k * stride + span[0], span[1] - span[0] + 1);
+  }
+  return s;
+}
+
+/* hopfield_field over the quantized weights, exact up to the scale. */
+static double hopfield_field_fixed(hopfield_t* hopfield, unsigned char* u) {
+  int r, n;
+  int stride, rxnz, rynz;
+  int s;
+  short *q;
+  int *span;
+
+  rxnz = hopfield->wfixed.rxnz;
+  rynz = hopfield->wfixed.rynz;
+  stride = hopfield->state.stride;
+  n = 2 * rxnz + 1;
+  q = hopfield->wfixed.q;
+  if (hopfield->window_fixed)
+    return hopfield->window_fixed(q, n, u - rynz * stride - rxnz, stride) / hopfield->wfixed.scale;
+  s = 0;
+  if (!hopfield->weights.sparse.offset) {
+    /* whole rows keep the integer kernel in its wide steps */
+    u -= rynz * stride + rxnz;
+    for (r = -rynz; r <= rynz; r++) {
+      s += dotprod_short_u8(q, u, n);
+      q += n;
+      u += stride;
+    }
+    return s / hopfield->wfixed.scale;
+  }
+  /* sparse weights, rounding does not widen their spans */
+  q += rynz * n + rxnz;
+  span = hopfield->weights.sparse.span;
+  for (r = -rynz; r <= rynz; r++, span += 2) {
+    if (span[0] <= span[1])
+      s += dotprod_short_u8(q + r * n + span[0], u + r * stride + span[0], span[1] - span[0] + 1);
+  }
+  return s / hopfield->wfixed.scale;
+}
+
+/* Sum of weights times the pixels in the window around u. */
+static double hopfield_field(hopfield_t* hopfield, unsigned char* u) {
+  int stride, rxnz, rynz;
+  double *w;
+
+  if (hopfield->wfixed.q) return hopfield_field_fixed(hopfield, u);
+  rxnz = hopfield->weights.rxnz;
+  rynz = hopfield->weights.rynz;
+  stride = hopfield->state.stride;
+  w = hopfield->weights.w + hopfield->weights.r2 * (hopfield->weights.size + 1);
+  if (hopfield->window)
+    return hopfield->window(w - rynz * hopfield->weights.size - rxnz, hopfield->weights.size, u - rynz * stride - rxnz, stride);
+  return hopfield_window(w, hopfield->weights.size, &(hopfield->weights.sparse), rynz, u, stride);
+}
+
+/* hopfield_field over the weights with the regularization folded in. */
+static double hopfield_field_folded(hopfield_t* hopfield, unsigned char* u) {
+  int n;
+  int stride, rxf, ryf;
+
+  rxf = hopfield->weights.rxf;
+  ryf = hopfield->weights.ryf;
+  stride = hopfield->state.stride;
+  n = 2 * rxf + 1;
+  if (hopfield->window_folded)
+    return hopfield->window_folded(hopfield->weights.folded, n, u - ryf * stride - rxf, stride);
+  return hopfield_window(hopfield->weights.folded + ryf * n + rxf, n, &(hopfield->weights.fsparse), ryf, u, stride);
+}
+
+/* Separable terms of the state: term k at padded row gy and column i
+ * is the window sum of row gy with row vector k, and the column vectors
+ * sum these up to the field. Stored by columns, hopfield_sep(k, i)[gy]
+ * is contiguous along gy in -rynz..y+rynz-1. */
+static double* hopfield_sep(hopfield_t* hopfield, int k, int i) {
+  int x, py;
+
+  x = hopfield->image->x;
+  py = hopfield->image->y + 2 * hopfield->weights.rynz;
+  return hopfield->sep + ((long)k * x + i) * py + hopfield->weights.rynz;
+}
+
+/* hopfield_field of pixel [i,j] from the separable terms. */
+static double hopfield_field_separable(hopfield_t* hopfield, int i, int j) {
+  lowrank_t *lowrank;
+  double s;
+  int k;
+
+  lowrank = &(hopfield->weights.lowrank);
+  s = 0.0;
+  for (k = 0; k < lowrank->rank; k++)
+    s += dotprod_double(lowrank->col + k * lowrank->ny, hopfield_sep(hopfield, k, i) + j - hopfield->weights.rynz, lowrank->ny);
+  return s;
+}
+
+/* Weights term of pixel [i,j], from the buffer in incremental mode. */
+static double hopfield_weighted(hopfield_t* hopfield, int i, int j, unsigned char* u) {
+  if (hopfield->field) return hopfield->field[j * hopfield->image->x + i];
+  if (hopfield->sep) return hopfield_field_separable(hopfield, i, j);
+  return hopfield_field(hopfield, u);
+}
+
+/* hopfield_field of pixel [i,j] in the n channels of group into s, one
+ * pass over the spans of the shared weights, the folded ones when there
+ * are. */
+static void hopfield_field_group(hopfield_t** group, int n, int i, int j, double* s) {
+  const unsigned char *u[3], *v[3];
+  hopfield_t *hopfield;
+  weights_sparse_t *sparse;
+  const int *span;
+  double *w, t[3];
+  int c, r, stride, rynz, size;
+
+  hopfield = group[0];
+  stride = hopfield->state.stride;
+  if (hopfield->weights.folded) {
+    rynz = hopfield->weights.ryf;
+    size = 2 * hopfield->weights.rxf + 1;
+    w = hopfield->weights.folded + rynz * size + hopfield->weights.rxf;
+    sparse = &(hopfield->weights.fsparse);
+  } else {
+    rynz = hopfield->weights.rynz;
+    size = hopfield->weights.size;
+    w = hopfield->weights.w + hopfield->weights.r2 * (size + 1);
+    sparse = &(hopfield->weights.sparse);
+  }
+  /* missing channels repeat the last one */
+  for (c = 0; c < 3; c++)
+    u[c] = group[min(c, n - 1)]->state.bdata + j * stride + i;
+  for (c = 0; c < n; c++)
+    s[c] = 0.0;
+  span = sparse->span;
+  for (r = -rynz; r <= rynz; r++, span += 2) {
+    if (span[0] > span[1]) continue;
+    for (c = 0; c < 3; c++)
+      v[c] = u[c] + r * stride + span[0];
+    dotprod_double_u8_x3(w + r * size + span[0], v, span[1] - span[0] + 1, t);
+    for (c = 0; c < n; c++)
+      s[c] += t[c];
+  }
+}
+
+/* Padded coordinates among -r..n-1+r holding a copy of pixel p. The
+ * image is wider than 2r, so there is at most one copy at each side. */
+static int hopfield_copies(const int* map, int p, int n, int r, int* g) {
+  int c, k;
+
+  k = 0;
+  g[k++] = p;
+  for (c = -r; c < 0; c++)
+    if (map[c] == p) g[k++] = c;
+  for (c = n; c < n + r; c++)
+    if (map[c] == p) g[k++] = c;
+  return k;
+}
+
+/* Add dk times the weights to the buffered field of every pixel whose
+ * window contains pixel [i,j] or one of its ghost copies. */
+static void hopfield_scatter(hopfield_t* hopfield, int i, int j, double dk) {
+  int x, y, rxnz, rynz;
+  int gx[3], gy[3];
+  int nx, ny, a, b;
+  int qy, qx0, qx1, qy0, qy1;
+  int size, r2;
+  int *span;
 
   x = hopfield->image->x;
   y = hopfield->image->y;
   rxnz = hopfield->weights.rxnz;
   rynz = hopfield->weights.rynz;
+  size = hopfield->weights.size;
+  r2 = hopfield->weights.r2;
+  nx = hopfield_copies(hopfield->state.mapx, i, x, rxnz, gx);
+  ny = hopfield_copies(hopfield->state.mapy, j, y, rynz, gy);
+  for (b = 0; b < ny; b++) {
+    qy0 = max(gy[b] - rynz, 0);
+    qy1 = min(gy[b] + rynz, y - 1);
+    for (a = 0; a < nx; a++) {
+      /* pixel q sees the copy through weight [g - q], that is flip [q - g],
+       * nonzero within the span of row q - g as the weights are symmetric */
+      for (qy = qy0; qy <= qy1; qy++) {
+        span = hopfield->weights.sparse.span + 2 * (qy - gy[b] + rynz);
+        qx0 = max(gx[a] + span[0], 0);
+        qx1 = min(gx[a] + span[1], x - 1);
+        if (qx0 <= qx1)
+          dotprod_axpy_double(dk, hopfield->flip + (r2 + qy - gy[b]) * size + r2 + qx0 - gx[a],
+                              hopfield->field + qy * x + qx0, qx1 - qx0 + 1);
+      }
+    }
+  }
+}
 
-  pom = weights_get(&(hopfield->weights), 0, 0) - 20.0 * hopfield->lambda;
-  Sum = 0.0;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (p = -rxnz; p <= rxnz; p++) {
-        for (r = -rynz; r <= rynz; r++) {
-          s += weights_get(&(hopfield->weights), p, r) * image_get_period(hopfield->image, i+p, j+r);
-        }
+/* Add dk times the row vectors to the separable terms of the padded
+ * rows holding pixel [i,j] or a ghost copy, at every column whose
+ * window contains it. */
+static void hopfield_sep_scatter(hopfield_t* hopfield, int i, int j, double dk) {
+  int x, y, rxnz, rynz;
+  int gx[3], gy[3];
+  int nx, ny, a, b, k;
+  int q, q0, q1;
+  double c;
+  lowrank_t *lowrank;
+
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  rxnz = hopfield->weights.rxnz;
+  rynz = hopfield->weights.rynz;
+  lowrank = &(hopfield->weights.lowrank);
+  nx = hopfield_copies(hopfield->state.mapx, i, x, rxnz, gx);
+  ny = hopfield_copies(hopfield->state.mapy, j, y, rynz, gy);
+  for (k = 0; k < lowrank->rank; k++) {
+    for (a = 0; a < nx; a++) {
+      q0 = max(gx[a] - rxnz, 0);
+      q1 = min(gx[a] + rxnz, x - 1);
+      for (q = q0; q <= q1; q++) {
+        c = dk * lowrank->row[k * lowrank->nx + gx[a] - q + rxnz];
+        for (b = 0; b < ny; b++)
+          hopfield_sep(hopfield, k, q)[gy[b]] += c;
       }
+    }
+  }
+}
 
-      z = 20.0 * image_get_period(hopfield->image, i,j);
-      z += image_get_period(hopfield->image, i+2, j);
-      z += image_get_period(hopfield->image, i-2, j);
-      z += 2.0 * (image_get_period(hopfield->image, i+1, j-1) +
-                  image_get_period(hopfield->image, i-1, j+1) +
-                  image_get_period(hopfield->image, i+1, j+1) +
-                  image_get_period(hopfield->image, i-1, j-1));
-      z += image_get_period(hopfield->image, i, j+2);
-      z += image_get_period(hopfield->image, i, j-2);
-      z += -8.0 * (image_get_period(hopfield->image, i+1, j  ) +
-                   image_get_period(hopfield->image, i  , j+1) +
-                   image_get_period(hopfield->image, i-1, j  ) +
-                   image_get_period(hopfield->image, i  , j-1));
-
-      s -= hopfield->lambda*z;
-
-      s += threshold_get(&(hopfield->threshold), i, j);
-      value = (int)(image_get(hopfield->image, i, j) + 0.5);
-
-      dui = hardlim(s);
-      ddui = dui;
-      dE = -2.0 * s * ddui - pom;
-      k = -(int)(s/pom) + dui;
-      if (dE < 0.0) {
-        if (k>0 && value < 255) {
-          k = min(k, 255 - value);
-          k = (rand()%k)+1;
-          value += k;
-          dk = k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-        } else if (k < 0 && value > 0) {
-          k = min(-k, value);
-          k = (rand()%k)+1;
-          value -= k;
-          dk = -k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-        }
-        image_set(hopfield->image, i, j, value);
+/* Queue the squares of every pixel whose field or regularization term
+ * reads pixel [i,j] or one of its ghost copies, for this sweep and the
+ * next one. */
+static void hopfield_mark(hopfield_t* hopfield, int i, int j) {
+  int x, y, r;
+  int gx[3], gy[3];
+  int nx, ny, a, b;
+  int qy, qx0, qx1, qy0, qy1;
+
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  r = hopfield->state.border;
+  nx = hopfield_copies(hopfield->state.mapx, i, x, r, gx);
+  ny = hopfield_copies(hopfield->state.mapy, j, y, r, gy);
+  for (b = 0; b < ny; b++) {
+    qy0 = max(gy[b] - r, 0) >> HOPFIELD_WORK_SHIFT;
+    qy1 = min(gy[b] + r, y - 1) >> HOPFIELD_WORK_SHIFT;
+    for (a = 0; a < nx; a++) {
+      qx0 = max(gx[a] - r, 0) >> HOPFIELD_WORK_SHIFT;
+      qx1 = min(gx[a] + r, x - 1) >> HOPFIELD_WORK_SHIFT;
+      for (qy = qy0; qy <= qy1; qy++) {
+        memset(hopfield->active + qy * hopfield->active_x + qx0, 1, qx1 - qx0 + 1);
+        memset(hopfield->queued + qy * hopfield->active_x + qx0, 1, qx1 - qx0 + 1);
       }
     }
   }
-  return Sum;
 }
 
-static double hopfield_iteration_period_lambda(hopfield_t* hopfield) {
-  int p, r;
-  int i, j;
+/* In worklist mode 0 when the square of pixel [i,j] is not queued. */
+static int hopfield_take(hopfield_t* hopfield, int i, int j) {
+  if (!hopfield->active) return 1;
+  return hopfield->active[(j >> HOPFIELD_WORK_SHIFT) * hopfield->active_x + (i >> HOPFIELD_WORK_SHIFT)];
+}
+
+/* Murmur3 finalizer, scrambles all bits of h. */
+static unsigned int hopfield_mix(unsigned int h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+/* Random step 1..k of pixel [i,j] in the current sweep. The number only
+ * depends on the seed, the stream, the sweep and the pixel, so it does
+ * not matter which thread updates the pixel or in what order.  Seed
+ * and stream are hashed apart, neighbouring seeds of different streams
+ * do not share steps.  k is at most 255, the upper 16 bits are scaled
+ * to the range instead of taking modulo. */
+static int hopfield_random(hopfield_t* hopfield, int i, int j, int k) {
+  unsigned int h;
+
+  h = hopfield_mix(hopfield->seed ^ hopfield_mix(hopfield->stream + 0x85ebca6bu));
+  h = hopfield_mix(h ^ hopfield_mix(hopfield->sweep + 0x9e3779b9u));
+  h = hopfield_mix(h ^ (unsigned int)(j * hopfield->image->x + i));
+  return (int)(((h >> 16) * (unsigned int)k) >> 16) + 1;
+}
+
+/* Quantized update of pixel [i,j] for the local field s, the energy
+ * decrease and the change are added to stat. */
+static void hopfield_update(hopfield_t* hopfield, int i, int j, double s, double pom, hopfield_stat_t* stat) {
   int k;
   int dui;
   double dE;
-  double Sum;
   double ddui;
   double dk;
-  double z;
   int value;
+
+  value = hopfield->state.bdata[j * hopfield->state.stride + i];
+
+  dui = hardlim(s);
+  ddui = dui;
+  dE = -2.0 * s * ddui - pom;
+  k = -(int)(s/pom) + dui;
+  if (dE < 0.0) {
+    if (k>0 && value < 255) {
+      k = min(k, 255 - value);
+      k = hopfield_random(hopfield, i, j, k);
+      value += k;
+      dk = k;
+      dE = (-2.0*s - pom*dk)*dk;
+    } else if (k < 0 && value > 0) {
+      k = min(-k, value);
+      k = hopfield_random(hopfield, i, j, k);
+      value -= k;
+      dk = -k;
+      dE = (-2.0*s - pom*dk)*dk;
+    } else {
+      dE = 0.0;
+      dk = 0.0;
+    }
+    if (hopfield->field && dk != 0.0)
+      hopfield_scatter(hopfield, i, j, dk);
+    if (hopfield->sep && dk != 0.0)
+      hopfield_sep_scatter(hopfield, i, j, dk);
+    if (hopfield->active && dk != 0.0)
+      hopfield_mark(hopfield, i, j);
+    if (dk != 0.0) {
+      stat->changed++;
+      stat->delta = max(stat->delta, k);
+    }
+    image_set(hopfield->image, i, j, value);
+    halo_set(&(hopfield->state), i, j, value);
+    stat->energy += dE;
+  }
+}
+
+/* Local field of pixel [i,j] from its weights term s: the regularization
+ * and the threshold are added, *pom gets the self coupling. */
+static double hopfield_local(hopfield_t* hopfield, int i, int j, double s, double* pom) {
+  double z;
+  unsigned char *u;
+  int stride;
+
+  stride = hopfield->state.stride;
+  u = hopfield->state.bdata + j * stride + i;
+
+  *pom = weights_get(&(hopfield->weights), 0, 0) - 20.0 * hopfield->lambda;
+
+  z = 20.0 * u[0];
+  z += u[2];
+  z += u[-2];
+  z += 2.0 * (u[1 - stride] + u[-1 + stride] + u[1 + stride] + u[-1 - stride]);
+  z += u[2 * stride];
+  z += u[-2 * stride];
+  z += -8.0 * (u[1] + u[stride] + u[-1] + u[-stride]);
+
+  s -= hopfield->lambda*z;
+
+  s += threshold_get(&(hopfield->threshold), i, j);
+  return s;
+}
+
+/* hopfield_local for s from the folded weights, which already hold the
+ * regularization. */
+static double hopfield_local_folded(hopfield_t* hopfield, int i, int j, double s, double* pom) {
+  *pom = weights_folded_get(&(hopfield->weights), 0, 0);
+  return s + threshold_get(&(hopfield->threshold), i, j);
+}
+
+/* hopfield_local with the lambda field, the stencil of the pixel is
+ * expanded from the five lambdas around it. */
+static double hopfield_local_lambda(hopfield_t* hopfield, int i, int j, double s, double* ppom) {
+  double z;
   double pom;
-  double lmbd00, lmbd01, lmbd10, lmbd_10, lmbd0_1;
-  double s;
+  unsigned char *u;
+  float *l, *c;
+  int stride, lstride, plane;
+
+  stride = hopfield->state.stride;
+  u = hopfield->state.bdata + j * stride + i;
+  lstride = hopfield->lambdafld->halo.stride;
+  l = hopfield->lambdafld->halo.fdata + j * lstride + i;
+  c = hopfield->lambdafld->coef + j * lstride + i;
+  plane = hopfield->lambdafld->plane;
+
+  /* the pairs above and to the left are stored at the neighbour */
+  pom = c[LAMBDA_CENTER * plane];
+  z = pom * u[0];
+  z += l[1] * u[2];
+  z += l[-1] * u[-2];
+  z += l[lstride] * u[2 * stride];
+  z += l[-lstride] * u[-2 * stride];
+  z += c[LAMBDA_RIGHT * plane] * u[1];
+  z += c[LAMBDA_RIGHT * plane - 1] * u[-1];
+  z += c[LAMBDA_DOWN * plane] * u[stride];
+  z += c[LAMBDA_DOWN * plane - lstride] * u[-stride];
+  z += c[LAMBDA_DIAG * plane] * u[1 + stride];
+  z += c[LAMBDA_DIAG * plane - 1 - lstride] * u[-1 - stride];
+  z += c[LAMBDA_ANTI * plane] * u[-1 + stride];
+  z += c[LAMBDA_ANTI * plane + 1 - lstride] * u[1 - stride];
+
+  s -= hopfield->lambda*z;
+  pom = -pom;
+  pom *= hopfield->lambda;
+
+  s += threshold_get(&(hopfield->threshold), i, j);
+  pom += weights_get(&(hopfield->weights), 0, 0);
+  *ppom = pom;
+  return s;
+}
+
+/* Channels of group whose worklist takes pixel [i,j] into take, their
+ * indices into index. Returns their number. */
+static int hopfield_take_group(hopfield_t** group, int n, int i, int j, hopfield_t** take, int* index) {
+  int c, m;
+
+  m = 0;
+  for (c = 0; c < n; c++) {
+    if (!hopfield_take(group[c], i, j)) continue;
+    take[m] = group[c];
+    index[m++] = c;
+  }
+  return m;
+}
+
+static void hopfield_pixel(hopfield_t** group, int n, int i, int j, hopfield_stat_t* stat) {
+  hopfield_t *take[HOPFIELD_CHANNELS];
+  int index[HOPFIELD_CHANNELS];
+  double s[HOPFIELD_CHANNELS], pom;
+  int c;
+
+  if (n == 1) {
+    if (!hopfield_take(group[0], i, j)) return;
+    if (group[0]->weights.folded) {
+      s[0] = hopfield_field_folded(group[0], group[0]->state.bdata + j * group[0]->state.stride + i);
+      s[0] = hopfield_local_folded(group[0], i, j, s[0], &pom);
+    } else {
+      s[0] = hopfield_weighted(group[0], i, j, group[0]->state.bdata + j * group[0]->state.stride + i);
+      s[0] = hopfield_local(group[0], i, j, s[0], &pom);
+    }
+    hopfield_update(group[0], i, j, s[0], pom, stat);
+    return;
+  }
+  if (!(n = hopfield_take_group(group, n, i, j, take, index))) return;
+  hopfield_field_group(take, n, i, j, s);
+  for (c = 0; c < n; c++) {
+    if (take[c]->weights.folded) s[c] = hopfield_local_folded(take[c], i, j, s[c], &pom);
+    else s[c] = hopfield_local(take[c], i, j, s[c], &pom);
+    hopfield_update(take[c], i, j, s[c], pom, stat + index[c]);
+  }
+}
+
+static void hopfield_pixel_lambda(hopfield_t** group, int n, int i, int j, hopfield_stat_t* stat) {
+  hopfield_t *take[HOPFIELD_CHANNELS];
+  int index[HOPFIELD_CHANNELS];
+  double s[HOPFIELD_CHANNELS], pom;
+  int c;
+
+  if (n == 1) {
+    if (!hopfield_take(group[0], i, j)) return;
+    s[0] = hopfield_weighted(group[0], i, j, group[0]->state.bdata + j * group[0]->state.stride + i);
+    s[0] = hopfield_local_lambda(group[0], i, j, s[0], &pom);
+    hopfield_update(group[0], i, j, s[0], pom, stat);
+    return;
+  }
+  if (!(n = hopfield_take_group(group, n, i, j, take, index))) return;
+  hopfield_field_group(take, n, i, j, s);
+  for (c = 0; c < n; c++) {
+    s[c] = hopfield_local_lambda(take[c], i, j, s[c], &pom);
+    hopfield_update(take[c], i, j, s[c], pom, stat + index[c]);
+  }
+}
+
+/* Visit all pixels of the rectangle [x0,x1) x [y0,y1) in row-major order. */
+static void hopfield_sweep_rect(hopfield_t** group, int n, hopfield_pixel_t pixel, hopfield_stat_t* stat, int x0, int y0, int x1, int y1) {
+  int i, j;
+
+  for (j = y0; j < y1; j++) {
+    for (i = x0; i < x1; i++) {
+      pixel(group, n, i, j, stat);
+    }
+  }
+}
+
+/* Visit all pixels of the tile [bx,by] in row-major order. */
+static void hopfield_sweep_block(hopfield_t** group, int n, hopfield_pixel_t pixel, hopfield_stat_t* stat, int bx, int by) {
+  int x0, y0;
+
+  x0 = bx * HOPFIELD_BLOCK_SIZE;
+  y0 = by * HOPFIELD_BLOCK_SIZE;
+  hopfield_sweep_rect(group, n, pixel, stat, x0, y0,
+                      min(x0 + HOPFIELD_BLOCK_SIZE, group[0]->image->x),
+                      min(y0 + HOPFIELD_BLOCK_SIZE, group[0]->image->y));
+}
+
+/* Color of tile b out of nb along one axis. Neighbouring tiles differ in
+ * color; with periodic boundary the last tile of an odd count touches
+ * the first one and gets a color of its own. */
+static int hopfield_tile_color(int b, int nb, int mirror) {
+  if (!mirror && nb > 1 && (nb & 1) && b == nb - 1) return 2;
+  return b & 1;
+}
+
+/* Multi-color Gauss-Seidel sweep. The image is cut into tiles at least
+ * one pixel wider than the reach of the update (weights and the
+ * regularization stencil), tiles of the same color do not see each
+ * other and are updated concurrently. Statistics of every tile are kept
+ * apart and summed in the tile order, so the result does not depend on
+ * the number of threads. Returns 0 when out of memory. */
+static int hopfield_sweep_colored(hopfield_t** group, int n, hopfield_pixel_t pixel, hopfield_stat_t* stat) {
+  hopfield_t *hopfield;
   int x, y;
-  int rxnz, rynz;
+  int size, nbx, nby;
+  int c, t, active, written;
+  hopfield_stat_t *stats;
 
+  hopfield = group[0];
   x = hopfield->image->x;
   y = hopfield->image->y;
-  rxnz = hopfield->weights.rxnz;
-  rynz = hopfield->weights.rynz;
+  active = written = 0;
+  for (c = 0; c < n; c++) {
+    active |= group[c]->active != NULL;
+    written |= group[c]->field || group[c]->sep || group[c]->active;
+  }
+  /* in incremental, separable and worklist mode a pixel also writes
+   * the field, separable terms and queue of its window, two tiles of
+   * one color must not write the same pixel or square */
+  size = hopfield->state.border;
+  if (active) size += 1 << HOPFIELD_WORK_SHIFT;
+  size = max(HOPFIELD_BLOCK_SIZE, (written ? 2 : 1) * size + 1);
+  /* spread the remainder so that no tile is narrower than size */
+  nbx = max(x / size, 1);
+  nby = max(y / size, 1);
+  if (!(stats = (hopfield_stat_t*)calloc(nbx * nby * n, sizeof(hopfield_stat_t))))
+    return 0;
 
-  Sum = 0.0;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (p = -rxnz; p <= rxnz; p++) {
-        for (r = -rynz; r <= rynz; r++) {
-          s += weights_get(&(hopfield->weights), p, r) * image_get_period(hopfield->image, i+p, j+r);
-        }
-      }
+  for (c = 0; c < 9; c++) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(hopfield->threads > 0 ? hopfield->threads : omp_get_max_threads())
+#endif
+    for (t = 0; t < nbx * nby; t++) {
+      int bx, by;
 
-      lmbd00  = lambda_get_period(hopfield->lambdafld, i  , j  );
-      lmbd01  = lambda_get_period(hopfield->lambdafld, i  , j+1);
-      lmbd10  = lambda_get_period(hopfield->lambdafld, i+1, j  );
-      lmbd_10 = lambda_get_period(hopfield->lambdafld, i-1, j  );
-      lmbd0_1 = lambda_get_period(hopfield->lambdafld, i  , j-1);
-
-      pom = (lmbd01 + lmbd10 + lmbd_10 + lmbd0_1 + 16.0 * lmbd00);
-      z = pom * image_get_period(hopfield->image, i, j);
-      z += lmbd10 * image_get_period(hopfield->image, i+2, j);
-      z += lmbd_10 * image_get_period(hopfield->image, i-2, j);
-      z += (lmbd10 + lmbd0_1) * image_get_period(hopfield->image, i+1, j-1);
-      z += (lmbd01 + lmbd_10) * image_get_period(hopfield->image, i-1, j+1);
-      z += (lmbd10 + lmbd01) * image_get_period(hopfield->image, i+1, j+1);
-      z += (lmbd0_1 + lmbd_10) * image_get_period(hopfield->image, i-1, j-1);
-      z += -4.0 * (lmbd10 + lmbd00) * image_get_period(hopfield->image, i+1, j);
-      z += -4.0 * (lmbd00 + lmbd_10) * image_get_period(hopfield->image, i-1, j);
-      z += lmbd01 * image_get_period(hopfield->image, i, j+2);
-      z += lmbd0_1 * image_get_period(hopfield->image, i, j-2);
-      z += -4.0 * (lmbd01 + lmbd00) * image_get_period(hopfield->image, i, j+1);
-      z += -4.0 * (lmbd00 + lmbd0_1) * image_get_period(hopfield->image, i, j-1);
-
-      s -= hopfield->lambda*z;
-      pom = -pom;
-      pom *= hopfield->lambda;
-
-      s += threshold_get(&(hopfield->threshold), i, j);
-      pom += weights_get(&(hopfield->weights), 0, 0);
-      value = (int)(image_get(hopfield->image, i, j) + 0.5);
-
-      dui = hardlim(s);
-      ddui = dui;
-      dE = -2.0 * s * ddui - pom;
-      k = -(int)(s/pom) + dui;
-      if (dE < 0.0) {
-        if (k>0 && value < 255) {
-          k = min(k, 255-value);
-          k = (rand()%k)+1;
-          value += k;
-          dk = k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-        } else if (k < 0 && value > 0) {
-          k = min(-k, value);
-          k = (rand()%k)+1;
-          value -= k;
-          dk = -k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-        }
-        image_set(hopfield->image, i, j, value);
-      }
+      bx = t % nbx;
+      by = t / nbx;
+      if (hopfield_tile_color(bx, nbx, hopfield->mirror) + 3 * hopfield_tile_color(by, nby, hopfield->mirror) != c)
+        continue;
+      hopfield_sweep_rect(group, n, pixel, stats + t * n,
+                          (int)((long)bx * x / nbx), (int)((long)by * y / nby),
+                          (int)((long)(bx + 1) * x / nbx), (int)((long)(by + 1) * y / nby));
     }
   }
-  return Sum;
+
+  for (t = 0; t < nbx * nby * n; t++) {
+    stat[t % n].energy += stats[t].energy;
+    stat[t % n].changed += stats[t].changed;
+    stat[t % n].delta = max(stat[t % n].delta, stats[t].delta);
+  }
+  free(stats);
+  return 1;
 }
 
-static double hopfield_iteration_mirror(hopfield_t* hopfield) {
-  double pom;
-  int p, r;
-  int i,j;
-  double s;
-  int k;
-  int dui;
-  double dE;
-  double Sum;
-  double ddui;
-  double dk;
-  double z;
+/* Sweep of the n channels of group, they share the order and the
+ * geometry of the first one. */
+static void hopfield_sweep(hopfield_t** group, int n, hopfield_pixel_t pixel) {
+  int i, j, c;
   int x, y;
-  int value;
-  int rxnz, rynz;
+  int bx, by, nbx, nby;
+  unsigned int m, k, b;
+  hopfield_t *hopfield;
+  hopfield_stat_t stat[HOPFIELD_CHANNELS];
 
+  hopfield = group[0];
   x = hopfield->image->x;
   y = hopfield->image->y;
-  rxnz = hopfield->weights.rxnz;
-  rynz = hopfield->weights.rynz;
+  nbx = (x + HOPFIELD_BLOCK_SIZE - 1) / HOPFIELD_BLOCK_SIZE;
+  nby = (y + HOPFIELD_BLOCK_SIZE - 1) / HOPFIELD_BLOCK_SIZE;
 
-  pom = weights_get(&(hopfield->weights), 0, 0) - 20.0 * hopfield->lambda;
-  Sum = 0.0;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (p = -rxnz; p <= rxnz; p++) {
-        for (r = -rynz; r <= rynz; r++) {
-          s += weights_get(&(hopfield->weights), p, r) * image_get_mirror(hopfield->image, i+p, j+r);
+  memset(stat, 0, sizeof(stat));
+  if (hopfield->order == HOPFIELD_ORDER_COLOR && hopfield_sweep_colored(group, n, pixel, stat)) {
+    for (c = 0; c < n; c++)
+      group[c]->stat = stat[c];
+    return;
+  }
+
+  switch (hopfield->order) {
+    case HOPFIELD_ORDER_COLUMN:
+      for (i = 0; i < x; i++) {
+        for (j = 0; j < y; j++) {
+          pixel(group, n, i, j, stat);
         }
       }
-
-      z = 20.0 * image_get_mirror(hopfield->image, i,j);
-      z += image_get_mirror(hopfield->image, i+2, j);
-      z += image_get_mirror(hopfield->image, i-2, j);
-      z += 2.0 * (image_get_mirror(hopfield->image, i+1, j-1) +
-                  image_get_mirror(hopfield->image, i-1, j+1) +
-                  image_get_mirror(hopfield->image, i+1, j+1) +
-                  image_get_mirror(hopfield->image, i-1, j-1));
-      z += image_get_mirror(hopfield->image, i, j+2);
-      z += image_get_mirror(hopfield->image, i, j-2);
-      z += -8.0 * (image_get_mirror(hopfield->image, i+1, j  ) +
-                   image_get_mirror(hopfield->image, i  , j+1) +
-                   image_get_mirror(hopfield->image, i-1, j  ) +
-                   image_get_mirror(hopfield->image, i  , j-1));
-
-      s -= hopfield->lambda*z;
-
-      s += threshold_get(&(hopfield->threshold), i, j);
-      value = (int)(image_get(hopfield->image, i, j) + 0.5);
-
-      dui = hardlim(s);
-      ddui = dui;
-      dE = -2.0 * s * ddui - pom;
-      k = -(int)(s/pom) + dui;
-      if (dE < 0.0) {
-        if (k>0 && value < 255) {
-          k = min(k, 255 - value);
-          k = (rand()%k)+1;
-          value += k;
-          dk = k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-        } else if (k < 0 && value > 0) {
-          k = min(-k, value);
-          k = (rand()%k)+1;
-          value -= k;
-          dk = -k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
+      break;
+    case HOPFIELD_ORDER_BLOCK:
+      for (by = 0; by < nby; by++) {
+        for (bx = 0; bx < nbx; bx++) {
+          hopfield_sweep_block(group, n, pixel, stat, bx, by);
         }
-        image_set(hopfield->image, i, j, value);
       }
-    }
+      break;
+    case HOPFIELD_ORDER_ZORDER:
+      /* tiles are visited along the Morton curve of the smallest
+       * power of two square grid covering the image */
+      for (k = 1; k < (unsigned int)nbx || k < (unsigned int)nby; k <<= 1);
+      for (m = 0; m < k * k; m++) {
+        bx = by = 0;
+        for (b = 0; (1u << b) < k; b++) {
+          bx |= ((m >> (2*b)) & 1) << b;
+          by |= ((m >> (2*b + 1)) & 1) << b;
+        }
+        if (bx < nbx && by < nby)
+          hopfield_sweep_block(group, n, pixel, stat, bx, by);
+      }
+      break;
+    case HOPFIELD_ORDER_ROW:
+    default:
+      for (j = 0; j < y; j++) {
+        for (i = 0; i < x; i++) {
+          pixel(group, n, i, j, stat);
+        }
+      }
+      break;
   }
-  return Sum;
+  for (c = 0; c < n; c++)
+    group[c]->stat = stat[c];
 }
 
-static double hopfield_iteration_mirror_lambda(hopfield_t* hopfield) {
-  int p, r;
-  int i, j;
-  int k;
-  int dui;
-  double dE;
-  double Sum;
-  double ddui;
-  double dk;
-  double z;
-  int value;
-  double pom;
-  double lmbd00, lmbd01, lmbd10, lmbd_10, lmbd0_1;
-  double s;
+/* Recompute the buffered weights term of all pixels. Allocates the
+ * buffer on first use and drops it when incremental mode is off or the
+ * image is too small for it. */
+static void hopfield_refresh(hopfield_t* hopfield) {
+  int i, j, n;
   int x, y;
-  int rxnz, rynz;
+
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  if (!hopfield->incremental || hopfield->sep || x <= 2 * hopfield->weights.rxnz || y <= 2 * hopfield->weights.rynz) {
+    free(hopfield->field);
+    free(hopfield->flip);
+    hopfield->field = hopfield->flip = NULL;
+    return;
+  }
+  if (!hopfield->field) {
+    n = hopfield->weights.size * hopfield->weights.size;
+    if (!(hopfield->flip = (double*)malloc(n * sizeof(double))))
+      return;
+    if (!(hopfield->field = (double*)malloc(x * y * sizeof(double)))) {
+      free(hopfield->flip);
+      hopfield->flip = NULL;
+      return;
+    }
+    for (i = 0; i < n; i++)
+      hopfield->flip[i] = hopfield->weights.w[n - 1 - i];
+    /* in fixed mode the updates scatter the quantized weights */
+    if (hopfield->wfixed.q) {
+      for (j = -hopfield->wfixed.rynz; j <= hopfield->wfixed.rynz; j++)
+        for (i = -hopfield->wfixed.rxnz; i <= hopfield->wfixed.rxnz; i++)
+          hopfield->flip[(hopfield->weights.r2 - j) * hopfield->weights.size + hopfield->weights.r2 - i] = weights_fixed_get(&(hopfield->wfixed), i, j);
+    }
+    hopfield->field_age = 0;
+  }
+  if (hopfield->field_age++ % HOPFIELD_FIELD_REFRESH)
+    return;
+
+#ifdef _OPENMP
+#pragma omp parallel for private(i) num_threads(hopfield->threads > 0 ? hopfield->threads : omp_get_max_threads())
+#endif
+  for (j = 0; j < y; j++) {
+    for (i = 0; i < x; i++) {
+      hopfield->field[j * x + i] = hopfield_field(hopfield, hopfield->state.bdata + j * hopfield->state.stride + i);
+    }
+  }
+}
+
+/* Set up the separable terms in separable mode, recomputed every
+ * HOPFIELD_FIELD_REFRESH iterations against the rounding of the
+ * updates.  They replace the incremental field buffer, which costs a
+ * full window per change.  Weights needing too many terms leave the
+ * separable mode. */
+static void hopfield_separate(hopfield_t* hopfield) {
+  int i, k, gy;
+  int x, y, rxnz, rynz;
+  lowrank_t *lowrank;
 
   x = hopfield->image->x;
   y = hopfield->image->y;
   rxnz = hopfield->weights.rxnz;
   rynz = hopfield->weights.rynz;
+  if (hopfield->separable && !weights_factorize(&(hopfield->weights), WEIGHTS_LOWRANK_TOL))
+    hopfield->separable = 0;
+  if (!hopfield->separable || x <= 2 * rxnz || y <= 2 * rynz) {
+    free(hopfield->sep);
+    hopfield->sep = NULL;
+    return;
+  }
+  lowrank = &(hopfield->weights.lowrank);
+  if (!hopfield->sep) {
+    if (!(hopfield->sep = (double*)malloc(sizeof(double) * lowrank->rank * x * (y + 2 * rynz))))
+      return;
+    hopfield->sep_age = 0;
+  }
+  if (hopfield->sep_age++ % HOPFIELD_FIELD_REFRESH)
+    return;
 
-  Sum = 0.0;
+#ifdef _OPENMP
+#pragma omp parallel for private(k, gy) num_threads(hopfield->threads > 0 ? hopfield->threads : omp_get_max_threads())
+#endif
   for (i = 0; i < x; i++) {
+    for (k = 0; k < lowrank->rank; k++) {
+      for (gy = -rynz; gy < y + rynz; gy++) {
+        hopfield_sep(hopfield, k, i)[gy] = dotprod_double_u8(lowrank->row + k * lowrank->nx,
+                                                             hopfield->state.bdata + gy * hopfield->state.stride + i - rxnz,
+                                                             lowrank->nx);
+      }
+    }
+  }
+}
+
+/* Transform of the weights on the padded plane of the spectral mode.
+ * The field sums w[m] u[p+m], the transform of that correlation is the
+ * conjugate of the one of w, the same as w is centrally symmetric. */
+static int hopfield_spectral_create(hopfield_t* hopfield) {
+  int i, j, n;
+  int x, y, b;
+  fft_t *fft;
+
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  b = hopfield->state.border;
+  fft = &(hopfield->fft);
+  if (!fft_create(fft, fft_size(x + 2 * b), fft_size(y + 2 * b)))
+    return 0;
+  n = fft->x * fft->y;
+  hopfield->spectrum = (double*)malloc(sizeof(double) * n);
+  hopfield->jacobi = (double*)malloc(sizeof(double) * 4 * x * y);
+  if (!hopfield->spectrum || !hopfield->jacobi) {
+    free(hopfield->spectrum);
+    free(hopfield->jacobi);
+    hopfield->spectrum = hopfield->jacobi = NULL;
+    fft_destroy(fft);
+    return 0;
+  }
+  memset(fft->data, 0, sizeof(fft_complex_t) * n);
+  for (j = -hopfield->weights.rynz; j <= hopfield->weights.rynz; j++)
+    for (i = -hopfield->weights.rxnz; i <= hopfield->weights.rxnz; i++)
+      fft->data[((j + fft->y) % fft->y) * fft->x + (i + fft->x) % fft->x].re = weights_get(&(hopfield->weights), i, j);
+  fft_forward(fft);
+  for (i = 0; i < n; i++)
+    hopfield->spectrum[i] = fft->data[i].re;
+  return 1;
+}
+
+static void hopfield_spectral_destroy(hopfield_t* hopfield) {
+  fft_destroy(&(hopfield->fft));
+  free(hopfield->spectrum);
+  free(hopfield->jacobi);
+  hopfield->spectrum = hopfield->jacobi = NULL;
+}
+
+/* Put the plane of x*y values at v, with its ghost copies up to the
+ * border of the state, into the padded plane, wrapped around. */
+static void hopfield_spectral_load(hopfield_t* hopfield, const double* v) {
+  int gx, gy;
+  int x, y, b;
+  fft_t *fft;
+  fft_complex_t *row;
+
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  b = hopfield->state.border;
+  fft = &(hopfield->fft);
+  memset(fft->data, 0, sizeof(fft_complex_t) * fft->x * fft->y);
+  for (gy = -b; gy < y + b; gy++) {
+    row = fft->data + ((gy + fft->y) % fft->y) * fft->x;
+    for (gx = -b; gx < x + b; gx++)
+      row[(gx + fft->x) % fft->x].re = v[hopfield->state.mapy[gy] * x + hopfield->state.mapx[gx]];
+  }
+}
+
+/* Local fields of all pixels of the state, self coupling included, into
+ * the real parts of the first y rows of x values of the padded plane,
+ * the self couplings into the plane at pom unless NULL.  The weights
+ * term comes from FFT of the state with its ghost border. */
+static void hopfield_spectral_fields(hopfield_t* hopfield, int lambdafld, double* pom) {
+  int i, j, k, n;
+  int gx, gy;
+  int x, y, b;
+  double self;
+  fft_t *fft;
+  fft_complex_t *row;
+
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  b = hopfield->state.border;
+  fft = &(hopfield->fft);
+  n = fft->x * fft->y;
+  memset(fft->data, 0, sizeof(fft_complex_t) * n);
+  for (gy = -b; gy < y + b; gy++) {
+    row = fft->data + ((gy + fft->y) % fft->y) * fft->x;
+    for (gx = -b; gx < x + b; gx++)
+      row[(gx + fft->x) % fft->x].re = hopfield->state.bdata[gy * hopfield->state.stride + gx];
+  }
+  fft_forward(fft);
+  for (k = 0; k < n; k++) {
+    fft->data[k].re *= hopfield->spectrum[k];
+    fft->data[k].im *= hopfield->spectrum[k];
+  }
+  fft_inverse(fft);
+#ifdef _OPENMP
+#pragma omp parallel for private(i, self, row) num_threads(hopfield->threads > 0 ? hopfield->threads : omp_get_max_threads())
+#endif
+  for (j = 0; j < y; j++) {
+    for (i = 0; i < x; i++) {
+      row = fft->data + j * fft->x + i;
+      if (lambdafld) row->re = hopfield_local_lambda(hopfield, i, j, row->re, &self);
+      else row->re = hopfield_local(hopfield, i, j, row->re, &self);
+      if (pom) pom[j * x + i] = self;
+    }
+  }
+}
+
+/* Damped Jacobi iteration: the field of every pixel is taken from the
+ * state before the iteration, its sum with the weights comes from FFT
+ * at a cost independent of the radius.  A single pixel step -s/pom
+ * would overshoot as all pixels move at once, the local fields are
+ * instead turned into steps by the inverse of the whole operator,
+ * weights and regularization, in the frequency domain.  That inverse is
+ * bounded by HOPFIELD_SPECTRAL_FLOOR and uses the largest lambda of the
+ * field.  The steps are halved, rounded at random and clipped to the
+ * pixel range, and as in the sweep a pixel only moves when that alone
+ * lowers its energy.  All pixels move at once, the energy change of the step
+ * is not the sum of the changes of the pixels; it is found from the
+ * fields after the step, which takes one more FFT.  A step that does
+ * not lower the energy is halved again, at most
+ * HOPFIELD_SPECTRAL_HALVINGS times.  Returns 0 when out of memory
+ * or when no step was taken, the sweep then does the iteration. */
+static int hopfield_spectral(hopfield_t* hopfield, int lambdafld) {
+  int i, j, k, h;
+  int x, y, value, changed, delta, lower;
+  double dk, dE, lambda, kc, a, least;
+  double *field, *pom, *step, *move;
+  fft_t *fft;
+  hopfield_stat_t *stat;
+
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  if (!hopfield->fft.data && !hopfield_spectral_create(hopfield))
+    return 0;
+  /* the buffers of the sweeps would go stale, they start over */
+  free(hopfield->field);
+  free(hopfield->flip);
+  free(hopfield->sep);
+  free(hopfield->active);
+  hopfield->field = hopfield->flip = hopfield->sep = NULL;
+  hopfield->active = hopfield->queued = NULL;
+  fft = &(hopfield->fft);
+  field = hopfield->jacobi;
+  pom = field + x * y;
+  step = pom + x * y;
+  move = step + x * y;
+
+  hopfield_spectral_fields(hopfield, lambdafld, pom);
+  for (j = 0; j < y; j++) {
+    for (i = 0; i < x; i++) {
+      field[j * x + i] = fft->data[j * fft->x + i].re;
+      /* a pixel held at 0 or 255 by its field does not move, nor may
+       * it move the others */
+      value = hopfield->state.bdata[j * hopfield->state.stride + i];
+      step[j * x + i] = field[j * x + i];
+      if ((value == 255 && step[j * x + i] > 0.0) || (value == 0 && step[j * x + i] < 0.0))
+        step[j * x + i] = 0.0;
+    }
+  }
+
+  /* steps: the local fields through the inverse of the operator */
+  lambda = hopfield->lambda;
+  if (lambdafld) {
+    a = 0.0;
+    for (j = 0; j < y; j++)
+      for (i = 0; i < x; i++)
+        a = max(a, hopfield->lambdafld->halo.fdata[j * hopfield->lambdafld->halo.stride + i]);
+    lambda *= a;
+  }
+  hopfield_spectral_load(hopfield, step);
+  fft_forward(fft);
+  least = HOPFIELD_SPECTRAL_FLOOR * fabs(weights_get(&(hopfield->weights), 0, 0) - 20.0 * lambda);
+  for (j = 0; j < fft->y; j++) {
+    for (i = 0; i < fft->x; i++) {
+      /* the 13 point stencil is the square of the 5 point laplacian */
+      kc = 4.0 - 2.0 * cos(2.0 * M_PI * i / fft->x) - 2.0 * cos(2.0 * M_PI * j / fft->y);
+      a = hopfield->spectrum[j * fft->x + i] - lambda * kc * kc;
+      a = -1.0 / min(a, -least);
+      fft->data[j * fft->x + i].re *= a;
+      fft->data[j * fft->x + i].im *= a;
+    }
+  }
+  fft_inverse(fft);
+  for (j = 0; j < y; j++)
+    for (i = 0; i < x; i++)
+      step[j * x + i] = fft->data[j * fft->x + i].re;
+
+  stat = &(hopfield->stat);
+  for (h = 1; h <= HOPFIELD_SPECTRAL_HALVINGS; h++) {
+    changed = delta = 0;
     for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (p = -rxnz; p <= rxnz; p++) {
-        for (r = -rynz; r <= rynz; r++) {
-          s += weights_get(&(hopfield->weights), p, r) * image_get_mirror(hopfield->image, i+p, j+r);
-        }
+      for (i = 0; i < x; i++) {
+        /* the step halved h times, rounded at random to the same mean */
+        dk = ldexp(step[j * x + i], -h) + (hopfield_random(hopfield, i, j, 65536) - 0.5) / 65536.0;
+        k = (int)floor(dk);
+        value = hopfield->state.bdata[j * hopfield->state.stride + i];
+        k = k > 0 ? min(k, 255 - value) : -min(-k, value);
+        if ((-2.0 * field[j * x + i] - pom[j * x + i] * k) * k >= 0.0) k = 0;
+        move[j * x + i] = k;
+        if (k == 0) continue;
+        changed++;
+        delta = max(delta, abs(k));
+        halo_set(&(hopfield->state), i, j, value + k);
       }
+    }
+    if (!changed) return 0;
 
-      lmbd00 =  lambda_get_mirror(hopfield->lambdafld, i  , j  );
-      lmbd01 =  lambda_get_mirror(hopfield->lambdafld, i  , j+1);
-      lmbd10 =  lambda_get_mirror(hopfield->lambdafld, i+1, j  );
-      lmbd_10 = lambda_get_mirror(hopfield->lambdafld, i-1, j  );
-      lmbd0_1 = lambda_get_mirror(hopfield->lambdafld, i  , j-1);
-
-      pom = (lmbd01 + lmbd10 + lmbd_10 + lmbd0_1 + 16.0 * lmbd00);
-      z = pom * image_get_mirror(hopfield->image, i, j);
-      z += lmbd10 * image_get_mirror(hopfield->image, i+2, j);
-      z += lmbd_10 * image_get_mirror(hopfield->image, i-2, j);
-      z += (lmbd10 + lmbd0_1) * image_get_mirror(hopfield->image, i+1, j-1);
-      z += (lmbd01 + lmbd_10) * image_get_mirror(hopfield->image, i-1, j+1);
-      z += (lmbd10 + lmbd01) * image_get_mirror(hopfield->image, i+1, j+1);
-      z += (lmbd0_1 + lmbd_10) * image_get_mirror(hopfield->image, i-1, j-1);
-      z += -4.0 * (lmbd10 + lmbd00) * image_get_mirror(hopfield->image, i+1, j);
-      z += -4.0 * (lmbd00 + lmbd_10) * image_get_mirror(hopfield->image, i-1, j);
-      z += lmbd01 * image_get_mirror(hopfield->image, i, j+2);
-      z += lmbd0_1 * image_get_mirror(hopfield->image, i, j-2);
-      z += -4.0 * (lmbd01 + lmbd00) * image_get_mirror(hopfield->image, i, j+1);
-      z += -4.0 * (lmbd00 + lmbd0_1) * image_get_mirror(hopfield->image, i, j-1);
-
-      s -= hopfield->lambda*z;
-      pom = -pom;
-      pom *= hopfield->lambda;
-
-      s += threshold_get(&(hopfield->threshold), i, j);
-      pom += weights_get(&(hopfield->weights), 0, 0);
-      value = (int)(image_get(hopfield->image, i, j) + 0.5);
-
-      dui = hardlim(s);
-      ddui = dui;
-      dE = -2.0 * s * ddui - pom;
-      k = -(int)(s/pom) + dui;
-      if (dE < 0.0) {
-        if (k>0 && value < 255) {
-          k = min(k, 255-value);
-          k = (rand()%k)+1;
-          value += k;
-          dk = k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-        } else if (k < 0 && value > 0) {
-          k = min(-k, value);
-          k = (rand()%k)+1;
-          value -= k;
-          dk = -k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-        }
-        image_set(hopfield->image, i, j, value);
+    hopfield_spectral_fields(hopfield, lambdafld, NULL);
+    /* E = -u(s + t) for the fields s of the state u, the weights of
+     * the mirror boundary need not be symmetric */
+    dE = 0.0;
+    for (j = 0; j < y; j++) {
+      for (i = 0; i < x; i++) {
+        a = fft->data[j * fft->x + i].re;
+        value = hopfield->state.bdata[j * hopfield->state.stride + i];
+        dE += (value - move[j * x + i]) * (field[j * x + i] - a);
+        dE -= move[j * x + i] * (a + threshold_get(&(hopfield->threshold), i, j));
+      }
+    }
+    lower = dE < 0.0;
+    for (j = 0; j < y; j++) {
+      for (i = 0; i < x; i++) {
+        if (move[j * x + i] == 0.0) continue;
+        value = hopfield->state.bdata[j * hopfield->state.stride + i];
+        if (lower) image_set(hopfield->image, i, j, value);
+        else halo_set(&(hopfield->state), i, j, value - (int)move[j * x + i]);
       }
     }
+    if (lower) {
+      stat->energy = dE;
+      stat->changed = changed;
+      stat->delta = delta;
+      return 1;
+    }
   }
-  return Sum;
+  return 0;
 }
 
-static hopfield_t* hopfield_create_mirror(hopfield_t* hopfield, convmask_t* convmask, image_t* image, lambda_t* lambdafld) {
-  hopfield->image = image;
-  hopfield->mirror = 1;
+/* Build or drop the quantized weights when the fixed mode is switched,
+ * the buffered field follows the weights it was summed with. */
+static void hopfield_quantize(hopfield_t* hopfield) {
+  if (!hopfield->fixed == !hopfield->wfixed.q)
+    return;
+  if (hopfield->wfixed.q)
+    weights_fixed_destroy(&(hopfield->wfixed));
+  else if (!weights_fixed_create(&(hopfield->wfixed), &(hopfield->weights)))
+    return; /* out of memory, stay in floating point */
+  hopfield->window_fixed = NULL;
+  if (hopfield->wfixed.q)
+    hopfield->window_fixed = window_short_u8(hopfield->wfixed.rxnz, hopfield->wfixed.rynz);
+  free(hopfield->field);
+  free(hopfield->flip);
+  hopfield->field = hopfield->flip = NULL;
+}
+
+/* Prepare the worklist for the next sweep: the squares queued during
+ * the last one, or all of them when the mode is switched on or lambda
+ * has changed. A square not queued has seen no change within the reach
+ * of its pixels since they were last visited, so they cannot change. */
+static void hopfield_schedule(hopfield_t* hopfield) {
+  int x, y, n;
+  int serial;
+
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  if (!hopfield->worklist || x <= 2 * hopfield->state.border || y <= 2 * hopfield->state.border) {
+    free(hopfield->active);
+    hopfield->active = hopfield->queued = NULL;
+    return;
+  }
+  hopfield->active_x = ((x - 1) >> HOPFIELD_WORK_SHIFT) + 1;
+  n = hopfield->active_x * (((y - 1) >> HOPFIELD_WORK_SHIFT) + 1);
+  serial = hopfield->lambdafld ? hopfield->lambdafld->serial : 0;
+  if (!hopfield->active) {
+    if (!(hopfield->active = (unsigned char*)malloc(2 * n)))
+      return;
+    hopfield->queued = hopfield->active + n;
+  } else if (hopfield->active_lambda == hopfield->lambda && hopfield->active_serial == serial) {
+    memcpy(hopfield->active, hopfield->queued, n);
+    memset(hopfield->queued, 0, n);
+    return;
+  }
+  memset(hopfield->active, 1, n);
+  memset(hopfield->queued, 0, n);
+  hopfield->active_lambda = hopfield->lambda;
+  hopfield->active_serial = serial;
+}
+
+/* With a constant lambda and the window sums in floating point, fold
+ * the regularization into the weights: a pixel then costs a single
+ * window sum and no separate pass over the stencil. */
+static void hopfield_fold(hopfield_t* hopfield) {
+  if (hopfield->field || hopfield->sep || hopfield->wfixed.q || (hopfield->lambdafld && hopfield->lambda > 1e-8))
+    weights_unfold(&(hopfield->weights));
+  else
+    weights_fold(&(hopfield->weights), hopfield->lambda); /* out of memory, stays unfolded */
+  hopfield->window_folded = NULL;
+  if (hopfield->weights.folded) {
+    weights_pack(&(hopfield->weights), hopfield->state.stride);
+    if (!hopfield->weights.fsparse.offset)
+      hopfield->window_folded = window_double_u8(hopfield->weights.rxf, hopfield->weights.ryf);
+  }
+}
+
+/* Everything a sweep reads besides the pixels, for the modes set. */
+static void hopfield_prepare(hopfield_t* hopfield) {
+  hopfield_spectral_destroy(hopfield);
+  hopfield_quantize(hopfield);
+  hopfield_separate(hopfield);
+  hopfield_refresh(hopfield);
+  hopfield_fold(hopfield);
+  hopfield_schedule(hopfield);
+}
+
+/* Nonzero when b can be swept together with a. */
+static int hopfield_fusable(hopfield_t* a, hopfield_t* b) {
+  return !b->spectral && a->image->x == b->image->x && a->image->y == b->image->y &&
+    a->lambda == b->lambda && a->mirror == b->mirror && a->order == b->order && a->threads == b->threads &&
+    a->state.border == b->state.border && a->weights.size == b->weights.size &&
+    !memcmp(a->weights.w, b->weights.w, sizeof(double) * a->weights.size * a->weights.size);
+}
+
+/* Weights of the composite blur, truncated when asked for. */
+static hopfield_t* hopfield_create_weights(hopfield_t* hopfield, convmask_t* convmask) {
   if (!(weights_create(&(hopfield->weights), convmask)))
     return NULL;
-  if (!(threshold_create_mirror(&(hopfield->threshold), convmask, image))) {
+  /* a smaller window for a bounded error of the weights */
+  if (hopfield->truncation > 0.0 && !weights_truncate(&(hopfield->weights), hopfield->truncation)) {
     weights_destroy(&(hopfield->weights));
     return NULL;
   }
-  hopfield->lambdafld = lambdafld;
   return hopfield;
 }
 
-static hopfield_t* hopfield_create_period(hopfield_t* hopfield, convmask_t* convmask, image_t* image, lambda_t* lambdafld) {
-  hopfield->image = image;
-  hopfield->mirror = 0;
-  if (!(weights_create(&(hopfield->weights), convmask)))
-    return NULL;
-  if (!(threshold_create_mirror(&(hopfield->threshold), convmask, image))) {
+/* The rest of create, once the weights and the threshold are there. */
+static hopfield_t* hopfield_create_state(hopfield_t* hopfield, image_t* image) {
+  int border;
+
+  /* the regularization stencil reaches 2 pixels away */
+  border = max(max(hopfield->weights.rxnz, hopfield->weights.rynz), 2);
+  /* the pixels only take the integer values 0..255 */
+  if (!(halo_create(&(hopfield->state), image->x, image->y, border, hopfield->mirror, HALO_BYTE))) {
+    threshold_destroy(&(hopfield->threshold));
     weights_destroy(&(hopfield->weights));
     return NULL;
   }
-  hopfield->lambdafld = lambdafld;
-  hopfield->lambdafld = lambdafld;
+  halo_load(&(hopfield->state), image->data);
+  hopfield->field = hopfield->flip = NULL;
+  hopfield->active = hopfield->queued = NULL;
+  hopfield->wfixed.q = NULL;
+  /* the weights keep their window, packed when sparse, else with the
+   * unrolled sum picked here */
+  hopfield->window = NULL;
+  if (!weights_pack(&(hopfield->weights), hopfield->state.stride))
+    hopfield->window = window_double_u8(hopfield->weights.rxnz, hopfield->weights.rynz);
+  hopfield->window_folded = NULL;
+  hopfield->window_fixed = NULL;
+  hopfield->sep = NULL;
+  fft_init(&(hopfield->fft));
+  hopfield->spectrum = hopfield->jacobi = NULL;
+  hopfield->sweep = 0;
   return hopfield;
 }
 
 /* Public functions */
 
 hopfield_t* hopfield_create(hopfield_t* hopfield, convmask_t* convmask, image_t* image, lambda_t* lambdafld) {
-  if (hopfield->mirror) return hopfield_create_mirror(hopfield, convmask, image, lambdafld);
-  else return hopfield_create_period(hopfield, convmask, image, lambdafld);
+  hopfield->image = image;
+  hopfield->lambdafld = lambdafld;
+  if (!hopfield_create_weights(hopfield, convmask))
+    return NULL;
+  if (!(threshold_create_mirror(&(hopfield->threshold), convmask, image))) {
+    weights_destroy(&(hopfield->weights));
+    return NULL;
+  }
+  return hopfield_create_state(hopfield, image);
+}
+
+/* As hopfield_create, only the weights are built from the composite of
+ * psf, the threshold filters by its factors in turn. */
+hopfield_t* hopfield_create_psf(hopfield_t* hopfield, psf_t* psf, image_t* image, lambda_t* lambdafld) {
+  convmask_t convmask;
+  weights_t weights;
+
+  if (!psf_composite(psf, &convmask))
+    return NULL;
+  if (!weights_create(&weights, &convmask)) {
+    convmask_destroy(&convmask);
+    return NULL;
+  }
+  convmask_destroy(&convmask);
+  return hopfield_create_psf_weights(hopfield, psf, &weights, image, lambdafld);
+}
+
+/* As hopfield_create_psf with the weights of the composite built by the
+ * caller, e.g. loaded from a cache; the hopfield takes them over, also
+ * when it fails. */
+hopfield_t* hopfield_create_psf_weights(hopfield_t* hopfield, psf_t* psf, weights_t* weights, image_t* image, lambda_t* lambdafld) {
+  hopfield->image = image;
+  hopfield->lambdafld = lambdafld;
+  hopfield->weights = *weights;
+  /* a smaller window for a bounded error of the weights */
+  if (hopfield->truncation > 0.0 && !weights_truncate(&(hopfield->weights), hopfield->truncation)) {
+    weights_destroy(&(hopfield->weights));
+    return NULL;
+  }
+  if (!(threshold_create_psf_mirror(&(hopfield->threshold), psf, image))) {
+    weights_destroy(&(hopfield->weights));
+    return NULL;
+  }
+  return hopfield_create_state(hopfield, image);
+}
+
+/* Starts again from the pixels of image, e.g. a solution of a coarser
+ * level or the observed image once more; the threshold stays the one of
+ * the image given to create. */
+void hopfield_restart(hopfield_t* hopfield) {
+  halo_load(&(hopfield->state), hopfield->image->data);
+  hopfield->sweep = 0;
+  free(hopfield->field);
+  free(hopfield->flip);
+  hopfield->field = hopfield->flip = NULL;
+  free(hopfield->active);
+  hopfield->active = hopfield->queued = NULL;
+  free(hopfield->sep);
+  hopfield->sep = NULL;
 }
 
 void hopfield_destroy(hopfield_t* hopfield) {
   weights_destroy(&(hopfield->weights));
   threshold_destroy(&(hopfield->threshold));
+  halo_destroy(&(hopfield->state));
+  free(hopfield->field);
+  free(hopfield->flip);
+  hopfield->field = hopfield->flip = NULL;
+  free(hopfield->active);
+  hopfield->active = hopfield->queued = NULL;
+  weights_fixed_destroy(&(hopfield->wfixed));
+  free(hopfield->sep);
+  hopfield->sep = NULL;
+  hopfield_spectral_destroy(hopfield);
 }
 
 double hopfield_iteration(hopfield_t* hopfield) {
-  double rv;
-  if (hopfield->mirror) {
-    if (hopfield->lambdafld && hopfield->lambda > 1e-8) rv = hopfield_iteration_mirror_lambda(hopfield);
-    else rv = hopfield_iteration_mirror(hopfield);
+  int lambdafld;
+
+  lambdafld = hopfield->lambdafld && hopfield->lambda > 1e-8;
+  hopfield->stat.energy = 0.0;
+  hopfield->stat.changed = hopfield->stat.delta = 0;
+  if (hopfield->spectral && hopfield_spectral(hopfield, lambdafld)) {
+    hopfield->sweep++;
+    return hopfield->stat.energy;
+  }
+  hopfield_prepare(hopfield);
+  if (lambdafld) hopfield_sweep(&hopfield, 1, hopfield_pixel_lambda);
+  else hopfield_sweep(&hopfield, 1, hopfield_pixel);
+  hopfield->sweep++;
+  return hopfield->stat.energy;
+}
+
+/* One iteration of each of the n channels of group, at most
+ * HOPFIELD_CHANNELS. Channels with the same weights, geometry and order
+ * are swept together, a pixel of all of them per visit; the result is
+ * the same as of hopfield_iteration of every channel. Returns the sum
+ * of the energy changes. */
+double hopfield_iteration_group(hopfield_t** group, int n) {
+  double energy;
+  int c, lambdafld;
+
+  if (n < 1) return 0.0;
+  lambdafld = group[0]->lambdafld && group[0]->lambda > 1e-8;
+  for (c = 1; c < n && c < HOPFIELD_CHANNELS; c++)
+    if (!hopfield_fusable(group[0], group[c]) || lambdafld != (group[c]->lambdafld && group[c]->lambda > 1e-8))
+      break;
+  energy = 0.0;
+  if (c < n || group[0]->spectral) {
+    for (c = 0; c < n; c++)
+      energy += hopfield_iteration(group[c]);
+    return energy;
+  }
+  for (c = 0; c < n; c++)
+    hopfield_prepare(group[c]);
+  /* only the spans of the window sums share work, buffered, separable,
+   * unrolled and packed ones are cheaper to read a channel at a time */
+  for (c = 0; c < n && !group[c]->field && !group[c]->sep && !group[c]->wfixed.q &&
+              !(group[c]->weights.folded ? group[c]->window_folded : group[c]->window) &&
+              !(group[c]->weights.folded ? group[c]->weights.fsparse.offset : group[c]->weights.sparse.offset) &&
+              !group[c]->weights.folded == !group[0]->weights.folded; c++);
+  if (c == n) {
+    hopfield_sweep(group, n, lambdafld ? hopfield_pixel_lambda : hopfield_pixel);
   } else {
-    if (hopfield->lambdafld && hopfield->lambda > 1e-8) rv = hopfield_iteration_period_lambda(hopfield);
-    else rv = hopfield_iteration_period(hopfield);
+    for (c = 0; c < n; c++)
+      hopfield_sweep(group + c, 1, lambdafld ? hopfield_pixel_lambda : hopfield_pixel);
   }
-  return rv;
+  for (c = 0; c < n; c++) {
+    group[c]->sweep++;
+    energy += group[c]->stat.energy;
+  }
+  return energy;
 }
 
 void hopfield_set_mirror(hopfield_t* hopfield, int mirror) {
   hopfield->mirror = mirror;
 }
+
+void hopfield_set_order(hopfield_t* hopfield, int order) {
+  hopfield->order = order;
+}
+
+void hopfield_set_threads(hopfield_t* hopfield, int threads) {
+  hopfield->threads = threads;
+}
+
+void hopfield_set_seed(hopfield_t* hopfield, unsigned int seed) {
+  hopfield->seed = seed;
+}
+
+void hopfield_set_stream(hopfield_t* hopfield, unsigned int stream) {
+  hopfield->stream = stream;
+}
+
+void hopfield_set_incremental(hopfield_t* hopfield, int incremental) {
+  hopfield->incremental = incremental;
+}
+
+void hopfield_set_worklist(hopfield_t* hopfield, int worklist) {
+  hopfield->worklist = worklist;
+}
+
+void hopfield_set_fixed(hopfield_t* hopfield, int fixed) {
+  hopfield->fixed = fixed;
+}
+
+void hopfield_set_spectral(hopfield_t* hopfield, int spectral) {
+  hopfield->spectral = spectral;
+}
+
+/* Fraction of the sum of squares of the weights hopfield_create may
+ * drop with their outer rings, 0 keeps them exact. */
+void hopfield_set_truncation(hopfield_t* hopfield, double truncation) {
+  hopfield->truncation = truncation;
+}
+
+/* Another lambda field, or NULL, for a network already created. Only
+ * the pointer changes, the caller must call hopfield_restart before the
+ * next iteration. */
+void hopfield_set_lambdafld(hopfield_t* hopfield, lambda_t* lambdafld) {
+  hopfield->lambdafld = lambdafld;
+}
+
+void hopfield_set_separable(hopfield_t* hopfield, int separable) {
+  hopfield->separable = separable;
+}
+
+/* Nonzero when in worklist mode nothing is queued for the next sweep. */
+int hopfield_converged(hopfield_t* hopfield) {
+  if (!hopfield->active) return 0;
+  if (hopfield->lambdafld && hopfield->lambdafld->serial != hopfield->active_serial) return 0;
+  return memchr(hopfield->queued, 1, hopfield->queued - hopfield->active) == NULL;
+}
@@ -26,22 +26,105 @@
 #include "weights.h"
 #include "threshold.h"
 #include "lambda.h"
+#include "halo.h"
+#include "fft.h"
+#include "window.h"
+#include "psf.h"
 
 C_DECL_BEGIN
 
+/* order in which hopfield_iteration visits the pixels */
+enum {
+  HOPFIELD_ORDER_ROW = 0,   /* row by row, follows the image memory layout */
+  HOPFIELD_ORDER_COLUMN,    /* column by column, the original sweep */
+  HOPFIELD_ORDER_BLOCK,     /* square tiles row by row, rows inside tile */
+  HOPFIELD_ORDER_ZORDER,    /* square tiles along the Morton curve */
+  HOPFIELD_ORDER_COLOR      /* tiles in colors, in parallel, see threads */
+};
+
+#define HOPFIELD_BLOCK_SIZE 64
+/* most channels hopfield_iteration_group sweeps together */
+#define HOPFIELD_CHANNELS 3
+/* iterations between full recomputations of the incremental field and
+ * of the separable terms */
+#define HOPFIELD_FIELD_REFRESH 16
+/* worklist granularity, pixels are queued in squares of 1 << shift */
+#define HOPFIELD_WORK_SHIFT 3
+/* least response of the spectral preconditioner, relative to the self
+ * coupling of a pixel */
+#define HOPFIELD_SPECTRAL_FLOOR 1.0
+/* times the spectral step is halved before the sweep takes over */
+#define HOPFIELD_SPECTRAL_HALVINGS 4
+/* mask radius from which the spectral mode gets lower in energy than
+ * the incremental sweep in the same time, measured on img/defocus.pgm */
+#define HOPFIELD_SPECTRAL_RADIUS 12
+
+/* statistics of the last hopfield_iteration */
+typedef struct {
+  double       energy;    /* energy change, the value returned */
+  int          changed;   /* number of pixels that changed */
+  int          delta;     /* largest change of a pixel value */
+} hopfield_stat_t;
+
 typedef struct {
   int          mirror;
+  int          order;
+  int          threads;   /* threads of HOPFIELD_ORDER_COLOR, 0 = all processors */
+  unsigned int seed;
+  unsigned int stream;    /* e.g. the channel, its own random steps for any seed */
+  unsigned int sweep;     /* iterations done, counter of the random steps */
+  int          incremental;
+  int          worklist;
+  int          fixed;     /* integer window sums over quantized weights */
+  int          separable; /* window sums over the factorized weights, replaces incremental */
+  int          spectral;  /* Jacobi steps with the field of all pixels from FFT */
+  double       truncation; /* energy fraction of the weights dropped by create, the threshold stays exact */
   image_t     *image;
   weights_t    weights;
+  weights_fixed_t wfixed; /* q is NULL unless in fixed mode */
+  window_double_u8_t window;        /* unrolled window sums of the weights, */
+  window_double_u8_t window_folded; /* of the folded and of the quantized */
+  window_short_u8_t  window_fixed;  /* ones, NULL for a generic window */
   double       lambda;
   lambda_t    *lambdafld;
   threshold_t  threshold;
+  halo_t       state;     /* padded working copy of image */
+  double      *field;     /* weights term of every pixel, incremental mode */
+  double      *flip;      /* weights mirrored through the center */
+  int          field_age;
+  double      *sep;       /* row sums of the separable terms, separable mode */
+  int          sep_age;
+  fft_t        fft;       /* padded plane, spectral mode */
+  double      *spectrum;  /* of the weights, real as they are symmetric */
+  double      *jacobi;    /* field, self coupling, step and move of every pixel */
+  unsigned char *active;  /* squares to visit in this sweep, worklist mode */
+  unsigned char *queued;  /* squares to visit in the next sweep */
+  int          active_x;
+  double       active_lambda;
+  int          active_serial;
+  hopfield_stat_t stat;
 } hopfield_t;
 
 hopfield_t* hopfield_create(hopfield_t* hopfield, convmask_t* convmask, image_t* image, lambda_t* lambdafld);
+hopfield_t* hopfield_create_psf(hopfield_t* hopfield, psf_t* psf, image_t* image, lambda_t* lambdafld);
+hopfield_t* hopfield_create_psf_weights(hopfield_t* hopfield, psf_t* psf, weights_t* weights, image_t* image, lambda_t* lambdafld);
 void hopfield_set_mirror(hopfield_t* hopfield, int mirror);
+void hopfield_set_order(hopfield_t* hopfield, int order);
+void hopfield_set_threads(hopfield_t* hopfield, int threads);
+void hopfield_set_seed(hopfield_t* hopfield, unsigned int seed);
+void hopfield_set_stream(hopfield_t* hopfield, unsigned int stream);
+void hopfield_set_incremental(hopfield_t* hopfield, int incremental);
+void hopfield_set_worklist(hopfield_t* hopfield, int worklist);
+void hopfield_set_fixed(hopfield_t* hopfield, int fixed);
+void hopfield_set_separable(hopfield_t* hopfield, int separable);
+void hopfield_set_spectral(hopfield_t* hopfield, int spectral);
+void hopfield_set_truncation(hopfield_t* hopfield, double truncation);
+void hopfield_set_lambdafld(hopfield_t* hopfield, lambda_t* lambdafld);
+void hopfield_restart(hopfield_t* hopfield);
 void hopfield_destroy(hopfield_t* hopfield);
 double hopfield_iteration(hopfield_t* hopfield);
+double hopfield_iteration_group(hopfield_t** group, int n);
+int hopfield_converged(hopfield_t* hopfield);
 
 C_DECL_END
 
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <errno.h>
 #include "image.h"
+#include "fft.h"
 
 #define LINE_LEN_BORDER_PPM 56
 #define LINE_LEN_BORDER_PGM 64
@@ -59,39 +60,99 @@ void image_destroy(image_t* image) {
   free(image->data);
 }
 
-image_t* image_convolve_mirror(image_t* dst, image_t* src, convmask_t* filter) {
+static image_t* image_convolve(image_t* dst, image_t* src, convmask_t* filter, int mirror) {
   int i, j, k, l, r;
   double value;
+  halo_t padded;
+  double *row;
+  int *span;
 
   r = filter->radius;
-  for (i = 0; i < src->x; i++) {
-    for (j = 0; j < src->y; j++) {
+  if (!(halo_create(&padded, src->x, src->y, r, mirror, HALO_DOUBLE)))
+    return NULL;
+  halo_load(&padded, src->data);
+  if (!convmask_span(filter)) {
+    halo_destroy(&padded);
+    return NULL;
+  }
+  /* sparse masks stay direct up to the nonzero terms of a dense one of
+   * FFT_CONVOLVE_RADIUS */
+  if (r >= FFT_CONVOLVE_RADIUS && filter->nnz >= (2 * FFT_CONVOLVE_RADIUS + 1) * (2 * FFT_CONVOLVE_RADIUS + 1)) {
+    if (!fft_convolve(dst->data, &padded, filter, 0))
+      dst = NULL;
+    halo_destroy(&padded);
+    return dst;
+  }
+  for (j = 0; j < src->y; j++) {
+    for (i = 0; i < src->x; i++) {
+      row = padded.data + j * padded.stride + i;
       value = 0.0;
-      for (k = -r; k <= r; k++) {
-        for (l = -r; l <= r; l++) {
-          value += convmask_get(filter, k,l) * image_get_mirror(src, i-k, j-l);
+      for (l = -r; l <= r; l++) {
+        span = filter->span + 2 * (l + r);
+        for (k = span[0]; k <= span[1]; k++) {
+          value += convmask_get(filter, k,l) * row[-l * padded.stride - k];
         }
       }
       image_set(dst, i, j, value);
     }
   }
+  halo_destroy(&padded);
   return dst;
 }
 
+image_t* image_convolve_mirror(image_t* dst, image_t* src, convmask_t* filter) {
+  return image_convolve(dst, src, filter, 1);
+}
+
 image_t* image_convolve_period(image_t* dst, image_t* src, convmask_t* filter) {
-  int i, j, k, l, r;
-  double value;
+  return image_convolve(dst, src, filter, 0);
+}
 
-  r = filter->radius;
-  for (i = 0; i < src->x; i++) {
-    for (j = 0; j < src->y; j++) {
-      value = 0.0;
-      for (k = -r; k <= r; k++) {
-        for (l = -r; l <= r; l++) {
-          value += convmask_get(filter, k,l) * image_get_period(src, i-k, j-l);
+/* Creates dst of half the size of src, rounded up, every pixel the mean
+ * of the 2x2 block it covers. */
+image_t* image_shrink(image_t* dst, image_t* src) {
+  int i, j, k, l, n;
+  double s;
+
+  if (!(image_create(dst, (src->x + 1) / 2, (src->y + 1) / 2)))
+    return NULL;
+  for (j = 0; j < dst->y; j++) {
+    for (i = 0; i < dst->x; i++) {
+      s = 0.0;
+      n = 0;
+      for (l = 2 * j; l < 2 * j + 2 && l < src->y; l++) {
+        for (k = 2 * i; k < 2 * i + 2 && k < src->x; k++) {
+          s += image_get(src, k, l);
+          n++;
         }
       }
-      image_set(dst, i, j, value);
+      image_set(dst, i, j, s / n);
+    }
+  }
+  return dst;
+}
+
+/* Fills dst with src scaled to its size, bilinear between the pixel
+ * centers and constant past the outer ones. */
+image_t* image_expand(image_t* dst, image_t* src) {
+  int i, j, i0, j0, i1, j1;
+  double fx, fy, a, b;
+
+  for (j = 0; j < dst->y; j++) {
+    fy = (j + 0.5) * src->y / dst->y - 0.5;
+    if (fy < 0.0) fy = 0.0;
+    j0 = (int)fy;
+    j1 = j0 + 1 < src->y ? j0 + 1 : j0;
+    fy -= j0;
+    for (i = 0; i < dst->x; i++) {
+      fx = (i + 0.5) * src->x / dst->x - 0.5;
+      if (fx < 0.0) fx = 0.0;
+      i0 = (int)fx;
+      i1 = i0 + 1 < src->x ? i0 + 1 : i0;
+      fx -= i0;
+      a = (1.0 - fx) * image_get(src, i0, j0) + fx * image_get(src, i1, j0);
+      b = (1.0 - fx) * image_get(src, i0, j1) + fx * image_get(src, i1, j1);
+      image_set(dst, i, j, (1.0 - fy) * a + fy * b);
     }
   }
   return dst;
@@ -24,6 +24,7 @@
 #include "compiler.h"
 #include "convmask.h"
 #include "boundary.h"
+#include "halo.h"
 
 C_DECL_BEGIN
 
@@ -47,6 +48,8 @@ void image_load_bytes_rgb(image_t* image, unsigned char* bytes, unsigned int cha
 
 image_t* image_convolve_mirror(image_t* dst, image_t* src, convmask_t* filter);
 image_t* image_convolve_period(image_t* dst, image_t* src, convmask_t* filter);
+image_t* image_shrink(image_t* dst, image_t* src);
+image_t* image_expand(image_t* dst, image_t* src);
 
 double image_get_mirror(image_t* image, int x, int y);
 double image_get_period(image_t* image, int x, int y);
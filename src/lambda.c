@@ -19,24 +19,31 @@
 
 #include "lambda.h"
 
-static void get_variance_mirror(image_t* variance, image_t* img, double* pmin, double* pmax, int winsize) {
+static image_t* get_variance(image_t* variance, image_t* img, double* pmin, double* pmax, int winsize, int mirror) {
   int i, j, k, l;
   double sum, sum2;
   double c;
   double num_points;
   double var, minvar, maxvar;
+  halo_t src;
+  double *row;
+
+  if (!(halo_create(&src, img->x, img->y, winsize, mirror, HALO_DOUBLE)))
+    return NULL;
+  halo_load(&src, img->data);
 
   minvar = 1e20;
   maxvar = 0.0;
   num_points = (double)((2*winsize+1)*(2*winsize+1));
 
-  for (i = 0; i < variance->x; i++) {
-    for (j = 0; j < variance->y; j++) {
+  for (j = 0; j < variance->y; j++) {
+    for (i = 0; i < variance->x; i++) {
+      row = src.data + j * src.stride + i;
       sum = 0.0;
       sum2 = 0.0;
       for (k = -winsize; k <= winsize; k++) {
         for (l = -winsize; l <= winsize; l++) {
-          c = image_get_mirror(img, i+k, j+l);
+          c = row[l * src.stride + k];
           sum += c;
           sum2 += c*c;
         }
@@ -50,50 +57,13 @@ static void get_variance_mirror(image_t* variance, image_t* img, double* pmin, d
         maxvar = var;
       } else if (var < minvar) {
         minvar = var;
-      }      
-    }
-  }
-  *pmax = maxvar;
-  *pmin = minvar;
-}
-
-static void get_variance_period(image_t* variance, image_t* img, double* pmin, double* pmax, int winsize) {
-  int i, j, k, l;
-  double sum, sum2;
-  double c;
-  double num_points;
-  double var, minvar, maxvar;
-
-  minvar = 1e20;
-  maxvar = 0.0;
-  num_points = (double)((2*winsize+1)*(2*winsize+1));
-
-  for (i = 0; i < variance->x; i++) {
-    for (j = 0; j < variance->y; j++) {
-      sum = 0.0;
-      sum2 = 0.0;
-      for (k = -winsize; k <= winsize; k++) {
-        for (l = -winsize; l <= winsize; l++) {
-          c = image_get_period(img, i+k, j+l);
-          sum += c;
-          sum2 += c*c;
-        }
       }
-      sum /= num_points;
-      sum2 /= num_points;
-      sum *= sum;
-      var = sum2 - sum;
-      image_set(variance, i, j, var);
-      if (var > maxvar) {
-        maxvar = var;
-      }
-      else if (var < minvar) {
-        minvar = var;
-      }      
     }
   }
   *pmax = maxvar;
   *pmin = minvar;
+  halo_destroy(&src);
+  return variance;
 }
 
 lambda_t* lambda_create(lambda_t* lambda, int x, int y, double minlambda, int winsize, convmask_t* filter) {
@@ -102,14 +72,26 @@ lambda_t* lambda_create(lambda_t* lambda, int x, int y, double minlambda, int wi
   lambda->minlambda = minlambda;
   lambda->winsize = winsize;
   lambda->filter = filter;
-  if ((lambda->lambda = (double*)malloc(sizeof(double) * x * y)))
-    return lambda;
-  /* out of memory, return NULL */
-  return NULL;
+  lambda->serial = 0;
+  /* the fields of the channels share the filter from their threads */
+  if (filter && !convmask_span(filter))
+    return NULL;
+  if (!halo_create(&(lambda->halo), x, y, LAMBDA_BORDER, lambda->mirror, HALO_FLOAT))
+    return NULL;
+  lambda->plane = lambda->halo.stride * (y + 2*LAMBDA_BORDER);
+  if (!(lambda->coef = (float*)malloc(sizeof(float) * LAMBDA_COEFS * lambda->plane))) {
+    halo_destroy(&(lambda->halo));
+    return NULL;
+  }
+  lambda->coef += LAMBDA_BORDER * (lambda->halo.stride + 1);
+  return lambda;
 }
 
 void lambda_destroy(lambda_t* lambda) {
-  free(lambda->lambda);
+  if (lambda->coef)
+    free(lambda->coef - LAMBDA_BORDER * (lambda->halo.stride + 1));
+  lambda->coef = NULL;
+  halo_destroy(&(lambda->halo));
 }
 
 void lambda_set_mirror(lambda_t* lambda, int mirror) {
@@ -120,12 +102,15 @@ void lambda_set_nl(lambda_t* lambda, int nl) {
   lambda->nl = nl;
 }
 
-static lambda_t* lambda_calculate_period(lambda_t* lambda, image_t* image) {
+/* Weights from the local variance of the image smoothed by the filter:
+ * falling linearly from 1 at the least variance to minlambda at the
+ * largest one, or in nl mode as 1 / (1 + alpha * variance). */
+static lambda_t* lambda_calculate_variance(lambda_t* lambda, image_t* image) {
   image_t imgenh, *imgcal;
   image_t variance;
   double minvar, maxvar;
-  double akoef, bkoef;
-  int i, size;
+  double akoef, bkoef, alpha, var;
+  int i, j;
 
   if (lambda->filter) {
     if (!(imgcal = image_create_copyparam(&imgenh, image)))
@@ -143,96 +128,24 @@ static lambda_t* lambda_calculate_period(lambda_t* lambda, image_t* image) {
     return NULL;
   }
 
-  get_variance_period(&variance, imgcal, &minvar, &maxvar, lambda->winsize);
-
-  bkoef = (1.0 - lambda->minlambda)/(minvar - maxvar);
-  akoef = 1.0 - (minvar*(1.0 - lambda->minlambda))/(minvar - maxvar);
-  
-  size = lambda->x * lambda->y;
-  for (i = 0; i < size; i++) {
-    lambda->lambda[i] = akoef + bkoef*variance.data[i];
-  }
-
-  if (lambda->filter) {
-    image_destroy(imgcal);
-  }
-  image_destroy(&variance);
-
-  return lambda;
-}
-
-static lambda_t* lambda_calculate_period_nl(lambda_t* lambda, image_t* image) {
-  image_t imgenh, *imgcal;
-  image_t variance;
-  double minvar, maxvar;
-  double alpha;
-  int i, size;
-
-  if (lambda->filter) {
-    if (!(imgcal = image_create_copyparam(&imgenh, image)))
-      return NULL;
-    if (!(image_convolve_period(imgcal, image, lambda->filter))) {
-      image_destroy(imgcal);
-      return NULL;
-    }
-  } else {
-    imgcal = image;
-  }
-
-  if (!(image_create_copyparam(&variance, imgcal))) {
+  if (!(get_variance(&variance, imgcal, &minvar, &maxvar, lambda->winsize, lambda->mirror))) {
     if (imgcal == &imgenh) image_destroy(imgcal);
+    image_destroy(&variance);
     return NULL;
   }
 
-  get_variance_period(&variance, imgcal, &minvar, &maxvar, lambda->winsize);
-
+  bkoef = (1.0 - lambda->minlambda)/(minvar - maxvar);
+  akoef = 1.0 - (minvar*(1.0 - lambda->minlambda))/(minvar - maxvar);
   alpha = (1.0-lambda->minlambda)/(lambda->minlambda*(maxvar-minvar));
-  
-  size = lambda->x * lambda->y;
-  for (i = 0; i < size; i++) {
-    lambda->lambda[i] = 1.0/(1.0+alpha*(variance.data[i]-minvar));
-  }
-
-  if (lambda->filter) {
-    image_destroy(imgcal);
-  }
-  image_destroy(&variance);
-
-  return lambda;
-}
-
-static lambda_t* lambda_calculate_mirror(lambda_t* lambda, image_t* image) {
-  image_t imgenh, *imgcal;
-  image_t variance;
-  double minvar, maxvar;
-  double akoef, bkoef;
-  int i, size;
 
-  if (lambda->filter) {
-    if (!(imgcal = image_create_copyparam(&imgenh, image)))
-      return NULL;
-    if (!(image_convolve_period(imgcal, image, lambda->filter))) {
-      image_destroy(imgcal);
-      return NULL;
+  for (j = 0; j < lambda->y; j++) {
+    for (i = 0; i < lambda->x; i++) {
+      var = image_get(&variance, i, j);
+      if (lambda->nl) lambda->halo.fdata[j * lambda->halo.stride + i] = 1.0/(1.0+alpha*(var-minvar));
+      else lambda->halo.fdata[j * lambda->halo.stride + i] = akoef + bkoef*var;
     }
-  } else {
-    imgcal = image;
-  }
-
-  if (!(image_create_copyparam(&variance, imgcal))) {
-    if (imgcal == &imgenh) image_destroy(imgcal);
-    return NULL;
-  }
-
-  get_variance_mirror(&variance, imgcal, &minvar, &maxvar, lambda->winsize);
-
-  bkoef = (1.0 - lambda->minlambda)/(minvar - maxvar);
-  akoef = 1.0 - (minvar*(1.0 - lambda->minlambda))/(minvar - maxvar);
-  
-  size = lambda->x * lambda->y;
-  for (i = 0; i < size; i++) {
-    lambda->lambda[i] = akoef + bkoef*variance.data[i];
   }
+  halo_fill(&(lambda->halo));
 
   if (lambda->filter) {
     image_destroy(imgcal);
@@ -242,61 +155,45 @@ static lambda_t* lambda_calculate_mirror(lambda_t* lambda, image_t* image) {
   return lambda;
 }
 
-static lambda_t* lambda_calculate_mirror_nl(lambda_t* lambda, image_t* image) {
-  image_t imgenh, *imgcal;
-  image_t variance;
-  double minvar, maxvar;
-  double alpha;
-  int i, size;
-
-  if (lambda->filter) {
-    if (!(imgcal = image_create_copyparam(&imgenh, image)))
-      return NULL;
-    if (!(image_convolve_period(imgcal, image, lambda->filter))) {
-      image_destroy(imgcal);
-      return NULL;
+/* The table of the regularization stencil from the weights around every
+ * pixel, summed in double and stored in single precision.  A pair is
+ * also kept where one of its pixels is a ghost the interior reaches. */
+static void lambda_coefficients(lambda_t* lambda) {
+  int i, j, s;
+  float *l, *c;
+
+  s = lambda->halo.stride;
+  for (j = -1; j <= lambda->y; j++) {
+    l = lambda->halo.fdata + j * s;
+    c = lambda->coef + j * s;
+    for (i = -1; i <= lambda->x; i++) {
+      if (j >= 0 && j < lambda->y && i >= 0 && i < lambda->x)
+        c[LAMBDA_CENTER * lambda->plane + i] = (float)((double)l[i + s] + l[i + 1] + l[i - 1] + l[i - s] + 16.0 * l[i]);
+      if (j >= 0 && j < lambda->y && i < lambda->x)
+        c[LAMBDA_RIGHT * lambda->plane + i] = (float)(-4.0 * ((double)l[i] + l[i + 1]));
+      if (j < lambda->y && i >= 0 && i < lambda->x)
+        c[LAMBDA_DOWN * lambda->plane + i] = (float)(-4.0 * ((double)l[i] + l[i + s]));
+      if (j < lambda->y && i < lambda->x)
+        c[LAMBDA_DIAG * lambda->plane + i] = (float)((double)l[i + 1] + l[i + s]);
+      if (j < lambda->y && i >= 0)
+        c[LAMBDA_ANTI * lambda->plane + i] = (float)((double)l[i - 1] + l[i + s]);
     }
-  } else {
-    imgcal = image;
   }
-
-  if (!(image_create_copyparam(&variance, imgcal))) {
-    if (imgcal == &imgenh) image_destroy(imgcal);
-    return NULL;
-  }
-
-  get_variance_mirror(&variance, imgcal, &minvar, &maxvar, lambda->winsize);
-
-  alpha = (1.0-lambda->minlambda)/(lambda->minlambda*(maxvar-minvar));
-  
-  size = lambda->x * lambda->y;
-  for (i = 0; i < size; i++) {
-    lambda->lambda[i] = 1.0/(1.0+alpha*(variance.data[i]-minvar));
-  }
-
-  if (lambda->filter) {
-    image_destroy(imgcal);
-  }
-  image_destroy(&variance);
-
-  return lambda;
 }
 
 lambda_t* lambda_calculate(lambda_t* lambda, image_t* image) {
-  if (lambda->mirror) {
-    if (lambda->nl) return lambda_calculate_mirror_nl(lambda, image);
-    else return lambda_calculate_mirror(lambda, image);
-  } else {
-    if (lambda->nl) return lambda_calculate_period_nl(lambda, image);
-    else return lambda_calculate_period(lambda, image);
-  }
+  lambda->serial++;
+  if (!lambda_calculate_variance(lambda, image))
+    return NULL;
+  lambda_coefficients(lambda);
+  return lambda;
 }
 
 double lambda_get_mirror(lambda_t* lambda, int x, int y) {
-  return lambda->lambda[boundary_normalize_mirror(y, lambda->y)*lambda->x + boundary_normalize_mirror(x, lambda->x)];
+  return halo_get(&(lambda->halo), boundary_normalize_mirror(x, lambda->x), boundary_normalize_mirror(y, lambda->y));
 }
 
 double lambda_get_period(lambda_t* lambda, int x, int y) {
-  return lambda->lambda[boundary_normalize_period(y, lambda->y)*lambda->x + boundary_normalize_period(x, lambda->x)];
+  return halo_get(&(lambda->halo), boundary_normalize_period(x, lambda->x), boundary_normalize_period(y, lambda->y));
 }
 
@@ -24,18 +24,35 @@
 #include "convmask.h"
 #include "image.h"
 #include "boundary.h"
+#include "halo.h"
 
 C_DECL_BEGIN
 
+/* lambda is read at most one pixel away from the image */
+#define LAMBDA_BORDER 1
+
+/* planes of the coefficient table, the regularization stencil as its
+ * center and the pairs of a pixel with the one to the right, below,
+ * below right and below left.  The coefficient of a neighbour above or
+ * to the left is the one of the pair stored at that neighbour. */
+enum {
+  LAMBDA_CENTER = 0,
+  LAMBDA_RIGHT, LAMBDA_DOWN, LAMBDA_DIAG, LAMBDA_ANTI,
+  LAMBDA_COEFS
+};
+
 typedef struct {
   convmask_t *filter;
   int         x;
   int         y;
   int         winsize;
   double      minlambda;
-  double     *lambda;
+  halo_t      halo;     /* single precision weights */
+  float      *coef;     /* LAMBDA_COEFS planes laid out as the halo, pixel [0,0] of the first */
+  int         plane;    /* floats from one plane to the next */
   int         mirror;
   int         nl;
+  int         serial;   /* bumped by every lambda_calculate */
 } lambda_t;
 
 lambda_t* lambda_create(lambda_t* lambda, int x, int y, double minlambda, int winsize, convmask_t* filter);
@@ -0,0 +1,165 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "lowrank.h"
+
+#define LOWRANK_SWEEPS 40
+
+/* One-sided Jacobi: rotate the columns of w (n columns of m) until they
+ * are orthogonal, accumulating the rotations in the columns of v. */
+static void lowrank_jacobi(double* w, double* v, int m, int n) {
+  int sweep, p, q, i, rotated;
+  double alpha, beta, gamma, zeta, t, c, s, wp, wq;
+  double *a, *b;
+
+  for (sweep = 0; sweep < LOWRANK_SWEEPS; sweep++) {
+    rotated = 0;
+    for (p = 0; p < n - 1; p++) {
+      for (q = p + 1; q < n; q++) {
+        a = w + p * m;
+        b = w + q * m;
+        alpha = beta = gamma = 0.0;
+        for (i = 0; i < m; i++) {
+          alpha += a[i] * a[i];
+          beta += b[i] * b[i];
+          gamma += a[i] * b[i];
+        }
+        if (fabs(gamma) <= 1e-15 * sqrt(alpha * beta)) continue;
+        rotated = 1;
+        zeta = (beta - alpha) / (2.0 * gamma);
+        t = (zeta >= 0.0 ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+        c = 1.0 / sqrt(1.0 + t * t);
+        s = c * t;
+        for (i = 0; i < m; i++) {
+          wp = a[i];
+          wq = b[i];
+          a[i] = c * wp - s * wq;
+          b[i] = s * wp + c * wq;
+        }
+        a = v + p * n;
+        b = v + q * n;
+        for (i = 0; i < n; i++) {
+          wp = a[i];
+          wq = b[i];
+          a[i] = c * wp - s * wq;
+          b[i] = s * wp + c * wq;
+        }
+      }
+    }
+    if (!rotated) break;
+  }
+}
+
+void lowrank_init(lowrank_t* lowrank) {
+  lowrank->rank = 0;
+  lowrank->col = NULL;
+  lowrank->row = NULL;
+}
+
+/* Factorize the ny x nx matrix a (rows stride apart) with the least rank
+ * whose Frobenius error, and so every entry's error, is at most tol.
+ * Returns NULL when that needs more than maxrank terms or memory. */
+lowrank_t* lowrank_create(lowrank_t* lowrank, const double* a, int nx, int ny, int stride, double tol, int maxrank) {
+  double *w, *v, *sigma;
+  double tail, best;
+  int x, y, k, l, rank;
+
+  lowrank_init(lowrank);
+  lowrank->nx = nx;
+  lowrank->ny = ny;
+  w = (double*)malloc(sizeof(double) * nx * ny);
+  v = (double*)malloc(sizeof(double) * nx * nx);
+  sigma = (double*)malloc(sizeof(double) * nx);
+  if (!w || !v || !sigma) {
+    free(w);
+    free(v);
+    free(sigma);
+    return NULL;
+  }
+  /* column x of a is w[x*ny..], v starts as the identity */
+  for (x = 0; x < nx; x++)
+    for (y = 0; y < ny; y++)
+      w[x * ny + y] = a[y * stride + x];
+  memset(v, 0, sizeof(double) * nx * nx);
+  for (x = 0; x < nx; x++)
+    v[x * nx + x] = 1.0;
+  lowrank_jacobi(w, v, ny, nx);
+
+  /* a = w v^T, column norms of w are the singular values */
+  tail = 0.0;
+  for (k = 0; k < nx; k++) {
+    sigma[k] = 0.0;
+    for (y = 0; y < ny; y++)
+      sigma[k] += w[k * ny + y] * w[k * ny + y];
+    tail += sigma[k];
+  }
+  for (rank = 0; rank < nx && tail > tol * tol; rank++) {
+    /* move the largest remaining term to position rank */
+    l = rank;
+    best = sigma[rank];
+    for (k = rank + 1; k < nx; k++)
+      if (sigma[k] > best) {
+        best = sigma[k];
+        l = k;
+      }
+    if (l != rank) {
+      sigma[l] = sigma[rank];
+      sigma[rank] = best;
+      for (y = 0; y < ny; y++) {
+        best = w[l * ny + y];
+        w[l * ny + y] = w[rank * ny + y];
+        w[rank * ny + y] = best;
+      }
+      for (x = 0; x < nx; x++) {
+        best = v[l * nx + x];
+        v[l * nx + x] = v[rank * nx + x];
+        v[rank * nx + x] = best;
+      }
+    }
+    tail -= sigma[rank];
+  }
+  free(sigma);
+  if (rank > maxrank || rank == 0) {
+    free(w);
+    free(v);
+    return NULL;
+  }
+  /* the leading columns are kept in place, shrinking cannot move them */
+  lowrank->rank = rank;
+  lowrank->col = w;
+  lowrank->row = v;
+  return lowrank;
+}
+
+void lowrank_destroy(lowrank_t* lowrank) {
+  free(lowrank->col);
+  free(lowrank->row);
+  lowrank_init(lowrank);
+}
+
+double lowrank_get(lowrank_t* lowrank, int x, int y) {
+  double s;
+  int k;
+
+  s = 0.0;
+  for (k = 0; k < lowrank->rank; k++)
+    s += lowrank->col[k * lowrank->ny + y] * lowrank->row[k * lowrank->nx + x];
+  return s;
+}
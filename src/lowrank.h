@@ -0,0 +1,44 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef _LOWRANK_H
+#define _LOWRANK_H
+
+#include "compiler.h"
+
+C_DECL_BEGIN
+
+/* Separable approximation of a ny x nx matrix,
+ * a[y][x] ~ sum of col[k*ny + y] * row[k*nx + x] over k < rank,
+ * from its singular value decomposition. */
+typedef struct {
+  int     rank;     /* 0 when not factorized */
+  int     nx;
+  int     ny;
+  double *col;      /* singular values folded in */
+  double *row;
+} lowrank_t;
+
+void lowrank_init(lowrank_t* lowrank);
+lowrank_t* lowrank_create(lowrank_t* lowrank, const double* a, int nx, int ny, int stride, double tol, int maxrank);
+void lowrank_destroy(lowrank_t* lowrank);
+double lowrank_get(lowrank_t* lowrank, int x, int y);
+
+C_DECL_END
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#include <string.h>
+#include "psf.h"
+
+psf_t* psf_create(psf_t* psf) {
+  psf->count = 0;
+  return psf;
+}
+
+void psf_destroy(psf_t* psf) {
+  int k;
+
+  for (k = 0; k < psf->count; k++)
+    convmask_destroy(psf->factor + k);
+  psf->count = 0;
+}
+
+/* Appends factor, the psf takes it over; a unit impulse is destroyed
+ * right away.  Returns NULL with factor untouched when the list is full. */
+psf_t* psf_add(psf_t* psf, convmask_t* factor) {
+  if (factor->radius == 0 && factor->coef[0] == 1.0) {
+    convmask_destroy(factor);
+    return psf;
+  }
+  if (psf->count == PSF_MAX_FACTORS)
+    return NULL;
+  psf->factor[psf->count++] = *factor;
+  return psf;
+}
+
+/* radius of the composite */
+int psf_radius(psf_t* psf) {
+  int k, r;
+
+  r = 0;
+  for (k = 0; k < psf->count; k++)
+    r += psf->factor[k].radius;
+  return r;
+}
+
+/* Creates convmask as the convolution of all factors. Returns NULL when
+ * out of memory. */
+convmask_t* psf_composite(psf_t* psf, convmask_t* convmask) {
+  int k;
+  convmask_t tmp;
+
+  if (!psf->count) {
+    if (!(convmask_create(convmask, 0)))
+      return NULL;
+    convmask_set(convmask, 0, 0, 1.0);
+    return convmask;
+  }
+  if (!(convmask_create(convmask, psf->factor[0].radius)))
+    return NULL;
+  memcpy(convmask->coef, psf->factor[0].coef, sizeof(double) * convmask->r21 * convmask->r21);
+  for (k = 1; k < psf->count; k++) {
+    tmp = *convmask;
+    if (!(convmask_convolve(convmask, &tmp, psf->factor + k))) {
+      convmask_destroy(&tmp);
+      return NULL;
+    }
+    convmask_destroy(&tmp);
+  }
+  return convmask;
+}
@@ -0,0 +1,45 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef _PSF_H
+#define _PSF_H
+
+#include "compiler.h"
+#include "convmask.h"
+
+C_DECL_BEGIN
+
+#define PSF_MAX_FACTORS 4
+
+/* Blur as the ordered convolution of its factors, e.g. defocus, gauss
+ * and motion.  Filtering by the factors one after another costs the sum
+ * of their sizes instead of the size of the composite mask. */
+typedef struct {
+  int         count;
+  convmask_t  factor[PSF_MAX_FACTORS];
+} psf_t;
+
+psf_t* psf_create(psf_t* psf);
+void psf_destroy(psf_t* psf);
+psf_t* psf_add(psf_t* psf, convmask_t* factor);
+int psf_radius(psf_t* psf);
+convmask_t* psf_composite(psf_t* psf, convmask_t* convmask);
+
+C_DECL_END
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+/* Checks the dot products picked for this machine against sums in
+ * double, over lengths that leave every tail of the SIMD kernels and
+ * over unaligned starts. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "dotprod.h"
+
+#define TEST_LENGTH 100
+
+int main(void) {
+  float af[TEST_LENGTH + 1], bf[TEST_LENGTH + 1];
+  double ad[TEST_LENGTH + 1], bd[TEST_LENGTH + 1];
+  double ref, mag, got;
+  int i, n, o, failed;
+
+  srand(1);
+  for (i = 0; i <= TEST_LENGTH; i++) {
+    af[i] = (float)(rand() - RAND_MAX / 2) / RAND_MAX;
+    bf[i] = (float)rand() / RAND_MAX * 255.0f;
+    ad[i] = af[i];
+    bd[i] = bf[i];
+  }
+  failed = 0;
+  for (o = 0; o < 2; o++) {
+    for (n = 0; n <= TEST_LENGTH; n++) {
+      ref = mag = 0.0;
+      for (i = 0; i < n; i++) {
+        ref += (double)af[o + i] * bf[o + i];
+        mag += fabs((double)af[o + i] * bf[o + i]);
+      }
+      got = dotprod_float(af + o, bf + o, n);
+      if (fabs(got - ref) > 1e-6 * (n + 1) * mag) {
+        printf("dotprod_float, length %d at %d: %g instead of %g\n", n, o, got, ref);
+        failed = 1;
+      }
+      got = dotprod_double(ad + o, bd + o, n);
+      if (fabs(got - ref) > 1e-15 * (n + 1) * mag) {
+        printf("dotprod_double, length %d at %d: %g instead of %g\n", n, o, got, ref);
+        failed = 1;
+      }
+    }
+  }
+  return failed;
+}
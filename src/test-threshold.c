@@ -0,0 +1,93 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+/* A blur of identities only, e.g. a radius below one pixel or a coarse
+ * level of a small one, leaves the psf without factors. The threshold is
+ * then the image and a network can be built and iterated. */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "blur.h"
+#include "psf.h"
+#include "threshold.h"
+#include "hopfield.h"
+
+#define TEST_X 40
+#define TEST_Y 30
+
+static int test_threshold(psf_t* psf, image_t* image, int mirror) {
+  threshold_t threshold;
+  int i, j, failed;
+
+  if (!(mirror ? threshold_create_psf_mirror(&threshold, psf, image) : threshold_create_psf_period(&threshold, psf, image))) {
+    printf("threshold of the identity, mirror %d: out of memory\n", mirror);
+    return 1;
+  }
+  failed = 0;
+  for (j = 0; j < image->y; j++)
+    for (i = 0; i < image->x; i++)
+      if (fabs(threshold_get(&threshold, i, j) - image_get(image, i, j)) > 1e-4)
+        failed = 1;
+  if (failed)
+    printf("threshold of the identity, mirror %d: not the image\n", mirror);
+  threshold_destroy(&threshold);
+  return failed;
+}
+
+int main(void) {
+  image_t image;
+  psf_t psf;
+  convmask_t defocus, gauss, motion;
+  hopfield_t hopfield;
+  int i, j, failed;
+
+  if (!image_create(&image, TEST_X, TEST_Y))
+    return 1;
+  for (j = 0; j < TEST_Y; j++)
+    for (i = 0; i < TEST_X; i++)
+      image_set(&image, i, j, (i * 7 + j * 13) % 256);
+  psf_create(&psf);
+  blur_create_defocus(&defocus, 0.3);
+  blur_create_gauss(&gauss, 0.0);
+  blur_create_motion(&motion, 0.0, 0.0);
+  psf_add(&psf, &defocus);
+  psf_add(&psf, &gauss);
+  psf_add(&psf, &motion);
+  if (psf.count) {
+    printf("%d factors left of identities\n", psf.count);
+    return 1;
+  }
+
+  failed = test_threshold(&psf, &image, 1);
+  failed |= test_threshold(&psf, &image, 0);
+
+  memset(&hopfield, 0, sizeof(hopfield));
+  hopfield.lambda = 0.1;
+  hopfield_set_mirror(&hopfield, 1);
+  if (!hopfield_create_psf(&hopfield, &psf, &image, NULL)) {
+    printf("network of the identity: out of memory\n");
+    failed = 1;
+  } else {
+    hopfield_iteration(&hopfield);
+    hopfield_destroy(&hopfield);
+  }
+  psf_destroy(&psf);
+  image_destroy(&image);
+  return failed;
+}
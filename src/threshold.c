@@ -17,56 +17,243 @@
  *
  */
 
+#include <string.h>
 #include "threshold.h"
+#include "dotprod.h"
+#include "lowrank.h"
+#include "fft.h"
 
-threshold_t* threshold_create_mirror(threshold_t* threshold, convmask_t* convmask, image_t* image) {
-  int i,j;
-  int k,l;
+/* Convolution of src with the factorized mask of radius r: every term
+ * filters the padded rows with its row vector and sums them with its
+ * column vector, into the src->x by src->y doubles of dst. Returns NULL
+ * when out of memory. */
+static double* threshold_separable(double* dst, halo_t* src, lowrank_t* lowrank, int r) {
+  int j, k, l, m, gy;
+  int x, y;
+  double *tmp, *t;
+
+  x = src->x;
+  y = src->y;
+  if (!(tmp = (double*)malloc(sizeof(double) * x * (y + 2*r))))
+    return NULL;
+  memset(dst, 0, sizeof(double) * x * y);
+  for (k = 0; k < lowrank->rank; k++) {
+    for (gy = -r; gy < y + r; gy++) {
+      t = tmp + (gy + r) * x;
+      memset(t, 0, sizeof(double) * x);
+      for (m = 0; m < lowrank->nx; m++)
+        dotprod_axpy_double(lowrank->row[k * lowrank->nx + m], src->data + gy * src->stride + m - r, t, x);
+    }
+    for (j = 0; j < y; j++)
+      for (l = 0; l < lowrank->ny; l++)
+        dotprod_axpy_double(lowrank->col[k * lowrank->ny + l], tmp + (j + l) * x, dst + j * x, x);
+  }
+  free(tmp);
+  return dst;
+}
+
+/* The direct sum only visits the nonzero spans of the rows, a thin
+ * motion blur costs a fraction of its square. */
+static double* threshold_direct(double* dst, halo_t* src, convmask_t* convmask) {
+  int i, j, l, r;
   double s;
-  int x, y, r;
+  double *row;
+  int *span;
 
-  threshold->x = x = image->x;
-  threshold->y = y = image->y;
   r = convmask->radius;
-  if (!(threshold->data = (double*)malloc(sizeof(double) * x * y)))
-    return NULL;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
+  for (j = 0; j < src->y; j++) {
+    for (i = 0; i < src->x; i++) {
+      row = src->data + j * src->stride + i;
       s = 0.0;
-      for (k = -r; k <= r; k++) {
-        for (l = -r; l <= r; l++) {
-          s += convmask_get(convmask, k, l) * image_get_mirror(image, k + i, l + j);
-        }
+      for (l = -r; l <= r; l++) {
+        span = convmask->span + 2 * (l + r);
+        if (span[0] <= span[1])
+          s += dotprod_double(convmask->coef + (l + r) * convmask->r21 + r + span[0], row + l * src->stride + span[0], span[1] - span[0] + 1);
       }
-      threshold->data[j * x + i] = s;
+      dst[j * src->x + i] = s;
     }
   }
-  return threshold;
+  return dst;
 }
 
-threshold_t* threshold_create_period(threshold_t* threshold, convmask_t* convmask, image_t* image) {
-  int i,j;
-  int k,l;
-  double s;
-  int x, y, r;
+/* Cost of the direct sum over the spans built by convmask_span. */
+static int threshold_direct_cost(convmask_t* convmask) {
+  int j, cost;
+
+  cost = convmask->nnz;
+  for (j = 0; j < convmask->r21; j++)
+    if (convmask->span[2*j] <= convmask->span[2*j + 1])
+      cost += THRESHOLD_ROW_COST;
+  return cost;
+}
+
+/* How threshold_correlate sums with a mask, chosen once per mask. */
+typedef struct {
+  lowrank_t lowrank;  /* separable terms, rank 0 when not taken */
+  int       cost;     /* multiply-adds per pixel */
+} threshold_plan_t;
+
+/* The cheapest of the separable, direct and FFT sums with the mask.
+ * The factorization is only tried for the ranks that could beat the
+ * FFT, wide masks skip it.  Returns the cost. */
+static int threshold_plan(threshold_plan_t* plan, convmask_t* convmask) {
+  int maxrank;
+
+  lowrank_init(&(plan->lowrank));
+  plan->cost = THRESHOLD_FFT_COST;
+  if (convmask->r21 < 1)
+    return plan->cost;
+  maxrank = (THRESHOLD_FFT_COST - 1) / (4 * convmask->r21);
+  if (maxrank > convmask->radius)
+    maxrank = convmask->radius;
+  if (maxrank > 0 &&
+      lowrank_create(&(plan->lowrank), convmask->coef, convmask->r21, convmask->r21, convmask->r21, THRESHOLD_LOWRANK_TOL, maxrank))
+    plan->cost = 4 * plan->lowrank.rank * convmask->r21;
+  if (convmask_span(convmask) && threshold_direct_cost(convmask) < plan->cost) {
+    plan->cost = threshold_direct_cost(convmask);
+    lowrank_destroy(&(plan->lowrank));
+  }
+  return plan->cost;
+}
+
+/* Correlation of src, padded by at least the radius of the mask, with
+ * the mask into the src->x by src->y doubles of dst, as planned.
+ * Returns NULL when out of memory. */
+static double* threshold_correlate(double* dst, halo_t* src, convmask_t* convmask, threshold_plan_t* plan) {
+  if (plan->lowrank.rank)
+    return threshold_separable(dst, src, &(plan->lowrank), convmask->radius);
+  if (plan->cost >= THRESHOLD_FFT_COST)
+    return fft_convolve(dst, src, convmask, 1);
+  return threshold_direct(dst, src, convmask);
+}
+
+/* Correlation of image with the factors of psf one after another, each
+ * as in its plan. The image is padded once by the radius of the
+ * composite and every factor keeps only the part of its result the rest
+ * of the cascade reads, so the borders come out as from the composite
+ * mask. Without factors it is the image. */
+static threshold_t* threshold_create(threshold_t* threshold, psf_t* psf, threshold_plan_t* plan, image_t* image, int mirror) {
+  int i, j, k;
+  int x, y, pad, next;
+  halo_t src, view;
+  double *buf, *dst;
 
   threshold->x = x = image->x;
   threshold->y = y = image->y;
-  r = convmask->radius;
-  if (!(threshold->data = (double*)malloc(sizeof(double) * x * y)))
+  pad = psf_radius(psf);
+  if (!(halo_create(&src, x, y, pad, mirror, HALO_DOUBLE)))
     return NULL;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (k = -r; k <= r; k++) { 
-        for (l = -r; l <= r; l++) {
-          s += convmask_get(convmask, k, l) * image_get_period(image, k + i, l + j);
-        }
-      }
-      threshold->data[j * x + i] = s;
+  halo_load(&src, image->data);
+  threshold->data = (float*)malloc(sizeof(float) * x * y);
+  /* a second buffer only to alternate between factors */
+  buf = psf->count > 1 ? (double*)malloc(sizeof(double) * (x + 2*pad) * (y + 2*pad)) : NULL;
+  dst = (double*)malloc(sizeof(double) * (x + 2*pad) * (y + 2*pad));
+  if (!threshold->data || (psf->count > 1 && !buf) || !dst) {
+    free(threshold->data);
+    free(buf);
+    free(dst);
+    halo_destroy(&src);
+    return NULL;
+  }
+  view = src;
+  for (k = 0; k < psf->count; k++) {
+    /* the output of factor k, padded by what the next ones need */
+    next = pad - psf->factor[k].radius;
+    view.x = x + 2*next;
+    view.y = y + 2*next;
+    view.data -= next * (view.stride + 1);
+    if (!threshold_correlate(dst, &view, psf->factor + k, plan + k)) {
+      free(threshold->data);
+      threshold->data = NULL;
+      break;
     }
+    view.data = dst + next * (view.x + 1);
+    view.stride = view.x;
+    pad = next;
+    /* the next factor reads this one, while it writes the other */
+    dst = buf;
+    buf = view.data - next * (view.stride + 1);
+  }
+  if (threshold->data) {
+    for (j = 0; j < y; j++)
+      for (i = 0; i < x; i++)
+        threshold->data[j * x + i] = (float)view.data[j * view.stride + i];
+  }
+  free(buf);
+  free(dst);
+  halo_destroy(&src);
+  return threshold->data ? threshold : NULL;
+}
+
+/* The cascade when its factors cost less than the composite, which
+ * takes the FFT as soon as it grows large and is then the cheaper.
+ * Every mask is planned once, for the choice and the filtering. */
+static threshold_t* threshold_create_factored(threshold_t* threshold, psf_t* psf, image_t* image, int mirror) {
+  int k, n, cost;
+  psf_t single;
+  threshold_plan_t plan[PSF_MAX_FACTORS + 1];  /* and the composite */
+  threshold_t* res;
+
+  /* all factors were identities, the threshold is the image */
+  if (!psf->count)
+    return threshold_create(threshold, psf, plan, image, mirror);
+  if (psf->count < 2) {
+    threshold_plan(plan, psf->factor);
+    res = threshold_create(threshold, psf, plan, image, mirror);
+    lowrank_destroy(&(plan[0].lowrank));
+    return res;
+  }
+  cost = 0;
+  for (n = 0; n < psf->count && cost < THRESHOLD_FFT_COST; n++)
+    cost += threshold_plan(plan + n, psf->factor + n);
+  single.count = 1;
+  res = NULL;
+  if (psf_composite(psf, single.factor)) {
+    /* the composite never costs more than the FFT */
+    if (threshold_plan(plan + n, single.factor) <= cost)
+      res = threshold_create(threshold, &single, plan + n, image, mirror);
+    else
+      res = threshold_create(threshold, psf, plan, image, mirror);
+    lowrank_destroy(&(plan[n].lowrank));
+    psf_destroy(&single);
   }
-  return threshold;
+  for (k = 0; k < n; k++)
+    lowrank_destroy(&(plan[k].lowrank));
+  return res;
+}
+
+/* the mask as a psf of its own, sharing the coefficients */
+static psf_t* threshold_psf(psf_t* psf, convmask_t* convmask) {
+  psf->count = 1;
+  psf->factor[0] = *convmask;
+  return psf;
+}
+
+threshold_t* threshold_create_mirror(threshold_t* threshold, convmask_t* convmask, image_t* image) {
+  psf_t psf;
+  threshold_t* res;
+
+  res = threshold_create_factored(threshold, threshold_psf(&psf, convmask), image, 1);
+  /* the spans are kept by the mask */
+  *convmask = psf.factor[0];
+  return res;
+}
+
+threshold_t* threshold_create_period(threshold_t* threshold, convmask_t* convmask, image_t* image) {
+  psf_t psf;
+  threshold_t* res;
+
+  res = threshold_create_factored(threshold, threshold_psf(&psf, convmask), image, 0);
+  *convmask = psf.factor[0];
+  return res;
+}
+
+threshold_t* threshold_create_psf_mirror(threshold_t* threshold, psf_t* psf, image_t* image) {
+  return threshold_create_factored(threshold, psf, image, 1);
+}
+
+threshold_t* threshold_create_psf_period(threshold_t* threshold, psf_t* psf, image_t* image) {
+  return threshold_create_factored(threshold, psf, image, 0);
 }
 
 void threshold_destroy(threshold_t* threshold) {
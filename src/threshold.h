@@ -23,17 +23,30 @@
 #include "compiler.h"
 #include "convmask.h"
 #include "image.h"
+#include "halo.h"
+#include "psf.h"
 
 C_DECL_BEGIN
 
+/* error allowed to the factorized convolution mask */
+#define THRESHOLD_LOWRANK_TOL 1e-9
+/* multiply-adds per pixel from which the FFT is faster, the rows of the
+ * separable terms count four times as they are summed twice, strided */
+#define THRESHOLD_FFT_COST 120
+/* what a row of the direct sum costs on top of its coefficients */
+#define THRESHOLD_ROW_COST 4
+
 typedef struct {
   int     x;
   int     y;
-  double *data;
+  float  *data;     /* stored in single precision, summed in double */
 } threshold_t;
 
 threshold_t* threshold_create_mirror(threshold_t* threshold, convmask_t* convmask, image_t* image);
 threshold_t* threshold_create_period(threshold_t* threshold, convmask_t* convmask, image_t* image);
+/* the same filtering by the factors of psf in turn */
+threshold_t* threshold_create_psf_mirror(threshold_t* threshold, psf_t* psf, image_t* image);
+threshold_t* threshold_create_psf_period(threshold_t* threshold, psf_t* psf, image_t* image);
 void threshold_destroy(threshold_t* threshold);
 double threshold_get(threshold_t* threshold, int x, int y);
 
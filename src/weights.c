@@ -17,71 +17,415 @@
  *
  */
 
+#include <string.h>
 #include "weights.h"
+#include "dotprod.h"
+
+static void weights_sparse_init(weights_sparse_t* sparse) {
+  sparse->span = sparse->offset = NULL;
+  sparse->value = NULL;
+  sparse->npacked = sparse->nnz = 0;
+}
+
+/* Spans of the window of 2*rx+1 by 2*ry+1 around w, its rows wstride
+ * apart. Returns NULL when out of memory. */
+static weights_sparse_t* weights_sparse_create(weights_sparse_t* sparse, const double* w, int wstride, int rx, int ry) {
+  int i, j;
+  int *span;
+
+  weights_sparse_init(sparse);
+  sparse->center = w[0];
+  if (!(sparse->span = (int*)malloc(sizeof(int) * 2 * (2 * ry + 1))))
+    return NULL;
+  for (j = -ry; j <= ry; j++) {
+    span = sparse->span + 2 * (j + ry);
+    span[0] = rx + 1;
+    span[1] = -rx - 1;
+    for (i = -rx; i <= rx; i++) {
+      if (w[j * wstride + i] == 0.0) continue;
+      if (i < span[0]) span[0] = i;
+      span[1] = i;
+    }
+    if (span[0] <= span[1])
+      sparse->nnz += span[1] - span[0] + 1;
+  }
+  return sparse;
+}
+
+static void weights_sparse_destroy(weights_sparse_t* sparse) {
+  free(sparse->span);
+  free(sparse->offset);
+  free(sparse->value);
+  weights_sparse_init(sparse);
+}
+
+/* Pack the nonzero weights of the rows before the center and of the
+ * center row left of it, the others are their mirror images.  Returns 1
+ * when packed. */
+static int weights_sparse_pack(weights_sparse_t* sparse, const double* w, int wstride, int rx, int ry, int stride) {
+  int i, j, k, n;
+  int *span;
+
+  if (sparse->offset)
+    return 1;
+  if (!sparse->span || sparse->nnz * WEIGHTS_SPARSE > (2 * rx + 1) * (2 * ry + 1))
+    return 0;
+  n = sparse->nnz / 2 + 1;
+  sparse->offset = (int*)malloc(sizeof(int) * n);
+  sparse->value = (double*)malloc(sizeof(double) * n);
+  if (!sparse->offset || !sparse->value) {
+    free(sparse->offset);
+    free(sparse->value);
+    sparse->offset = NULL;
+    sparse->value = NULL;
+    return 0;
+  }
+  k = 0;
+  for (j = -ry; j <= 0; j++) {
+    span = sparse->span + 2 * (j + ry);
+    for (i = span[0]; i <= span[1] && (j < 0 || i < 0); i++) {
+      if (w[j * wstride + i] == 0.0) continue;
+      sparse->offset[k] = j * stride + i;
+      sparse->value[k++] = w[j * wstride + i];
+    }
+  }
+  sparse->npacked = k;
+  return 1;
+}
 
 static void weights_set(weights_t* weights, int x, int y, double value) {
   weights->w[(weights->r2 + y) * weights->size + (weights->r2 + x)] = value;
   weights->w[weights->stride + y * weights->size + x] = value;
 }
 
+/* Zero weights of a mask of radius r. */
+static weights_t* weights_alloc(weights_t* weights, int r) {
+  weights->r2 = 2 * r;
+  weights->size = 2 * weights->r2 + 1;
+  weights->stride = weights->r2 * (weights->size + 1);
+  lowrank_init(&(weights->lowrank));
+  weights->folded = NULL;
+  weights_sparse_init(&(weights->sparse));
+  weights_sparse_init(&(weights->fsparse));
+  weights->refs = NULL;
+  if (!(weights->w = (double*)calloc(weights->size * weights->size, sizeof(double))))
+    return NULL; /* memory full */
+  return weights;
+}
+
 weights_t* weights_create(weights_t* weights, convmask_t* convmask) {
   int r, r2, i, j, k, l;
   int rxnz, rynz;
-  double s;
+  int first, last;
+  double c;
+  double *center;
+  int *span;
   int size;
 
   rxnz = rynz = 0;
   r = convmask->radius;
-  weights->r2 = r2 = 2 * r;
-  weights->size = size = 2*r2 + 1;
-  weights->stride = r2 * (size + 1);
-  if (!(weights->w = (double*)malloc(sizeof(double) * size * size)))
-    return NULL; /* memory full */
+  if (!weights_alloc(weights, r))
+    return NULL;
+  r2 = weights->r2;
+  size = weights->size;
+  center = weights->w + weights->stride;
+  span = convmask_span(convmask) ? convmask->span : NULL;
 
-  for (i = 0; i <= r2; i++) {
-    for (j = 0; j <= r2; j++) {
-      s = 0.0;
-      for (k = -r; k <= r-i; k++) {
-        for (l = -r; l <= r-j; l++) {
-          s -= convmask_get(convmask, k, l) * convmask_get(convmask, k+i, l+j);
-        }
+  /* w(i, j) = -sum c(k, l) c(k+i, l+j): the rows j >= 0 as the nonzero
+   * coefficients of row l times row l+j, the others are their mirror */
+  for (j = 0; j <= r2; j++) {
+    for (l = -r; l + j <= r; l++) {
+      first = span ? span[2 * (l + j + r)] : -r;
+      last = span ? span[2 * (l + j + r) + 1] : r;
+      if (first > last) continue;
+      for (k = span ? span[2 * (l + r)] : -r; k <= (span ? span[2 * (l + r) + 1] : r); k++) {
+        if ((c = convmask_get(convmask, k, l)) == 0.0) continue;
+        dotprod_axpy_double(-c, convmask->coef + (l + j + r) * convmask->r21 + r + first,
+                            center + j * size + first - k, last - first + 1);
       }
-      if (fabs(s) > 1e-6) {
-        if (i > rxnz) rxnz = i;
-        if (j > rynz) rynz = j;
-      }
-      weights_set(weights,  i,  j, s);
-      weights_set(weights, -i, -j, s);
-
-      s = 0.0;
-      for (k = -r; k <= r-i; k++) {
-        for (l = -r; l <= r-j; l++) {
-          s -= convmask_get(convmask, k, l+j) * convmask_get(convmask, k+i, l);
-        }
-      }
-      if (fabs(s) > 1e-6) {
-        if (i > rxnz) rxnz = i;
+    }
+  }
+  for (j = 1; j <= r2; j++)
+    for (i = -r2; i <= r2; i++)
+      center[-j * size - i] = center[j * size + i];
+
+  for (j = 0; j <= r2; j++) {
+    for (i = -r2; i <= r2; i++) {
+      if (fabs(center[j * size + i]) > 1e-6) {
+        if (abs(i) > rxnz) rxnz = abs(i);
         if (j > rynz) rynz = j;
       }
-      weights_set(weights, -i,  j, s);
-      weights_set(weights,  i, -j, s);
     }
   }
+  weights->rxnz = rxnz;
+  weights->rynz = rynz;
+
+  if (!weights_sparse_create(&(weights->sparse), center, size, rxnz, rynz)) {
+    free(weights->w);
+    return NULL;
+  }
+  return weights;
+}
 
+/* Weights of a mask of radius from a copy of w and its nonzero window,
+ * as weights_create left them, e.g. saved to a file. Returns NULL when
+ * out of memory. */
+weights_t* weights_create_copy(weights_t* weights, int radius, const double* w, int rxnz, int rynz) {
+  if (!weights_alloc(weights, radius))
+    return NULL;
+  memcpy(weights->w, w, sizeof(double) * weights->size * weights->size);
   weights->rxnz = rxnz;
   weights->rynz = rynz;
+  if (!weights_sparse_create(&(weights->sparse), weights->w + weights->stride, weights->size, rxnz, rynz)) {
+    free(weights->w);
+    return NULL;
+  }
+  return weights;
+}
+
+/* Weights over the same w as src, which is freed with the last of them;
+ * everything built from w later is their own.  The count is not
+ * atomic, share and destroy from one thread.  Returns NULL when out of
+ * memory. */
+weights_t* weights_share(weights_t* weights, weights_t* src) {
+  if (!src->refs) {
+    if (!(src->refs = (int*)malloc(sizeof(int))))
+      return NULL;
+    *src->refs = 1;
+  }
+  weights->r2 = src->r2;
+  weights->size = src->size;
+  weights->stride = src->stride;
+  weights->rxnz = src->rxnz;
+  weights->rynz = src->rynz;
+  lowrank_init(&(weights->lowrank));
+  weights->folded = NULL;
+  weights_sparse_init(&(weights->fsparse));
+  weights->w = NULL;
+  weights->refs = NULL;
+  if (!weights_sparse_create(&(weights->sparse), src->w + src->stride, src->size, src->rxnz, src->rynz))
+    return NULL;
+  weights->w = src->w;
+  weights->refs = src->refs;
+  (*weights->refs)++;
+  return weights;
+}
+
+/* A w of its own before it is written. Returns NULL when out of memory. */
+static weights_t* weights_unshare(weights_t* weights) {
+  double *w;
 
+  if (!weights->refs || *weights->refs == 1)
+    return weights;
+  if (!(w = (double*)malloc(sizeof(double) * weights->size * weights->size)))
+    return NULL;
+  memcpy(w, weights->w, sizeof(double) * weights->size * weights->size);
+  (*weights->refs)--;
+  weights->refs = NULL;
+  weights->w = w;
   return weights;
 }
 
 void weights_destroy(weights_t* weights) {
+  if (weights->refs && --(*weights->refs) > 0)
+    weights->w = NULL;
+  else
+    free(weights->refs);
+  weights->refs = NULL;
   free(weights->w);
+  lowrank_destroy(&(weights->lowrank));
+  weights_sparse_destroy(&(weights->sparse));
+  weights_unfold(weights);
 }
 
 double weights_get(weights_t* weights, int x, int y) {
   return weights->w[(weights->r2 + y) * weights->size + (weights->r2 + x)];
 }
 
+/* Factorize the nonzero window into separable terms within tol, as
+ * long as a window sum costs at most a quarter of the dense one, the
+ * terms also have to be kept up to date as the pixels change.  The
+ * error of every weight is checked again, an unconverged decomposition
+ * is not trusted.  Returns the rank, 0 when the weights stay dense. */
+int weights_factorize(weights_t* weights, double tol) {
+  int i, j;
+
+  if (weights->lowrank.rank) return weights->lowrank.rank;
+  if (!lowrank_create(&(weights->lowrank),
+                      weights->w + (weights->r2 - weights->rynz) * weights->size + weights->r2 - weights->rxnz,
+                      2 * weights->rxnz + 1, 2 * weights->rynz + 1, weights->size, tol, weights->rxnz / 2))
+    return 0;
+  for (j = -weights->rynz; j <= weights->rynz; j++)
+    for (i = -weights->rxnz; i <= weights->rxnz; i++)
+      if (fabs(lowrank_get(&(weights->lowrank), i + weights->rxnz, j + weights->rynz) - weights_get(weights, i, j)) > tol) {
+        lowrank_destroy(&(weights->lowrank));
+        return 0;
+      }
+  return weights->lowrank.rank;
+}
+
+/* Weight [x,y] minus lambda times the regularization stencil, the 13
+ * point square of the laplacian, zero outside of both. */
+static double weights_fold_get(weights_t* weights, double lambda, int x, int y) {
+  static const double stencil[5][5] = {
+    { 0.0,  0.0,  1.0,  0.0, 0.0 },
+    { 0.0,  2.0, -8.0,  2.0, 0.0 },
+    { 1.0, -8.0, 20.0, -8.0, 1.0 },
+    { 0.0,  2.0, -8.0,  2.0, 0.0 },
+    { 0.0,  0.0,  1.0,  0.0, 0.0 }
+  };
+  double w;
+
+  w = 0.0;
+  if (abs(x) <= weights->r2 && abs(y) <= weights->r2)
+    w = weights_get(weights, x, y);
+  if (abs(x) <= 2 && abs(y) <= 2)
+    w -= lambda * stencil[y + 2][x + 2];
+  return w;
+}
+
+/* Fold the regularization of a constant lambda into the weights, one
+ * window sum then gives both terms of the local field.  The nonzero
+ * window is found again: the stencil reaches 2 pixels away and may
+ * cancel some weights. */
+weights_t* weights_fold(weights_t* weights, double lambda) {
+  int i, j, rx, ry, nx;
+
+  if (weights->folded && weights->lambda == lambda) return weights;
+  weights_unfold(weights);
+  rx = weights->rxnz > 2 ? weights->rxnz : 2;
+  ry = weights->rynz > 2 ? weights->rynz : 2;
+  weights->rxf = weights->ryf = 0;
+  for (j = -ry; j <= ry; j++) {
+    for (i = -rx; i <= rx; i++) {
+      if (fabs(weights_fold_get(weights, lambda, i, j)) > WEIGHTS_LOWRANK_TOL) {
+        if (abs(i) > weights->rxf) weights->rxf = abs(i);
+        if (abs(j) > weights->ryf) weights->ryf = abs(j);
+      }
+    }
+  }
+  nx = 2 * weights->rxf + 1;
+  if (!(weights->folded = (double*)malloc(sizeof(double) * nx * (2 * weights->ryf + 1))))
+    return NULL; /* memory full */
+  for (j = -weights->ryf; j <= weights->ryf; j++)
+    for (i = -weights->rxf; i <= weights->rxf; i++)
+      weights->folded[(j + weights->ryf) * nx + i + weights->rxf] = weights_fold_get(weights, lambda, i, j);
+  if (!weights_sparse_create(&(weights->fsparse), weights->folded + weights->ryf * nx + weights->rxf, nx, weights->rxf, weights->ryf)) {
+    weights_unfold(weights);
+    return NULL;
+  }
+  weights->lambda = lambda;
+  return weights;
+}
+
+void weights_unfold(weights_t* weights) {
+  free(weights->folded);
+  weights->folded = NULL;
+  weights_sparse_destroy(&(weights->fsparse));
+}
+
+/* Pack the sparse windows of the weights and of the folded ones for a
+ * plane of the stride. Returns 1 when the weights got packed. */
+int weights_pack(weights_t* weights, int stride) {
+  if (weights->folded)
+    weights_sparse_pack(&(weights->fsparse), weights->folded + weights->ryf * (2 * weights->rxf + 1) + weights->rxf,
+                        2 * weights->rxf + 1, weights->rxf, weights->ryf, stride);
+  return weights_sparse_pack(&(weights->sparse), weights->w + weights->r2 * (weights->size + 1),
+                             weights->size, weights->rxnz, weights->rynz, stride);
+}
+
+double weights_folded_get(weights_t* weights, int x, int y) {
+  return weights->folded[(weights->ryf + y) * (2 * weights->rxf + 1) + (weights->rxf + x)];
+}
+
+/* Drop the outer rings of the nonzero window as long as they hold at
+ * most the fraction loss of the sum of squares of the weights, before
+ * they are factorized, folded or packed; rxnz, rynz give the window
+ * left.  Returns NULL when out of memory. */
+weights_t* weights_truncate(weights_t* weights, double loss) {
+  int i, j, r;
+  double total, dropped, ring, w;
+
+  if (!weights_unshare(weights))
+    return NULL;
+  r = weights->rxnz > weights->rynz ? weights->rxnz : weights->rynz;
+  total = 0.0;
+  for (j = -weights->rynz; j <= weights->rynz; j++)
+    for (i = -weights->rxnz; i <= weights->rxnz; i++)
+      total += weights_get(weights, i, j) * weights_get(weights, i, j);
+  dropped = 0.0;
+  for (; r > 0; r--) {
+    ring = 0.0;
+    for (j = -r; j <= r; j++) {
+      for (i = -r; i <= r; i++) {
+        if (abs(i) != r && abs(j) != r) continue;
+        if (abs(i) > weights->rxnz || abs(j) > weights->rynz) continue;
+        w = weights_get(weights, i, j);
+        ring += w * w;
+      }
+    }
+    if (dropped + ring > loss * total) break;
+    dropped += ring;
+  }
+  /* the dropped weights are zero for every reader of w */
+  for (j = -weights->r2; j <= weights->r2; j++)
+    for (i = -weights->r2; i <= weights->r2; i++)
+      if (abs(i) > r || abs(j) > r) weights_set(weights, i, j, 0.0);
+  if (weights->rxnz > r) weights->rxnz = r;
+  if (weights->rynz > r) weights->rynz = r;
+  weights_sparse_destroy(&(weights->sparse));
+  if (!weights_sparse_create(&(weights->sparse), weights->w + weights->r2 * (weights->size + 1), weights->size, weights->rxnz, weights->rynz))
+    return NULL;
+  return weights;
+}
+
+weights_fixed_t* weights_fixed_create(weights_fixed_t* fixed, weights_t* weights) {
+  int i, j, nx, ny;
+  double w, wmax, wsum, bound;
+
+  fixed->rxnz = weights->rxnz;
+  fixed->rynz = weights->rynz;
+  nx = 2 * fixed->rxnz + 1;
+  ny = 2 * fixed->rynz + 1;
+  if (!(fixed->q = (short*)malloc(sizeof(short) * nx * ny)))
+    return NULL; /* memory full */
+
+  wmax = wsum = 0.0;
+  for (j = -fixed->rynz; j <= fixed->rynz; j++) {
+    for (i = -fixed->rxnz; i <= fixed->rxnz; i++) {
+      w = fabs(weights_get(weights, i, j));
+      if (w > wmax) wmax = w;
+      wsum += w;
+    }
+  }
+  /* largest power of two keeping |q| <= 32767 and 255 * sum |q| < 2^31 */
+  if (wmax > 0.0) {
+    bound = 32767.0 / wmax;
+    if (bound > 2147483647.0 / (255.0 * wsum)) bound = 2147483647.0 / (255.0 * wsum);
+    frexp(bound, &i);
+    fixed->scale = ldexp(1.0, i - 1);
+  } else {
+    fixed->scale = 1.0;
+  }
+
+  for (j = 0; j < ny; j++) {
+    for (i = 0; i < nx; i++) {
+      w = weights_get(weights, i - fixed->rxnz, j - fixed->rynz) * fixed->scale;
+      fixed->q[j * nx + i] = (short)(w < 0.0 ? w - 0.5 : w + 0.5);
+    }
+  }
+  return fixed;
+}
+
+void weights_fixed_destroy(weights_fixed_t* fixed) {
+  free(fixed->q);
+  fixed->q = NULL;
+}
+
+double weights_fixed_get(weights_fixed_t* fixed, int x, int y) {
+  return fixed->q[(fixed->rynz + y) * (2 * fixed->rxnz + 1) + (fixed->rxnz + x)] / fixed->scale;
+}
+
 #if defined(NDEBUG)
 void weights_print(weights_t* weights, FILE* file) {
   int i, j;
@@ -22,20 +22,70 @@
 
 #include "compiler.h"
 #include "convmask.h"
+#include "lowrank.h"
 
 C_DECL_BEGIN
 
+/* error allowed to weights_factorize, weights below it count as zero
+ * when the window rxnz, rynz is found */
+#define WEIGHTS_LOWRANK_TOL 1e-6
+/* windows with at most 1 / WEIGHTS_SPARSE of their weights nonzero are
+ * packed by weights_pack */
+#define WEIGHTS_SPARSE 4
+
+/* Nonzero part of a centrally symmetric window of 2*rx+1 by 2*ry+1:
+ * the first and last nonzero column of every row and, once packed, the
+ * half before the center as offsets into a plane with their weights.
+ * The window sum at u is then center * u[0] plus every value times
+ * u[offset] + u[-offset]. */
+typedef struct {
+  int    *span;     /* pairs for the rows -ry..ry, first > last when empty */
+  int     nnz;      /* weights between first and last of the rows */
+  int    *offset;   /* NULL unless packed */
+  double *value;
+  int     npacked;
+  double  center;
+} weights_sparse_t;
+
 typedef struct {
   double *w;
+  int    *refs;     /* owners of w, NULL unless weights_share */
   int     r2;
   int     rxnz, rynz;
   int     stride;
   int     size;
+  lowrank_t lowrank;  /* separable nonzero window, rank 0 when dense */
+  weights_sparse_t sparse;  /* of the window rxnz, rynz */
+  double *folded;     /* w - lambda * stencil, NULL unless weights_fold */
+  double  lambda;     /* folded into folded */
+  int     rxf, ryf;   /* nonzero window of folded, its 2*ryf+1 rows of 2*rxf+1 */
+  weights_sparse_t fsparse; /* of the window rxf, ryf */
 } weights_t;
 
+/* The nonzero window of weights_t in fixed point, w = q / scale.  The
+ * scale is a power of two small enough that a window sum over 8-bit
+ * pixels fits into an int. */
+typedef struct {
+  short  *q;        /* 2*rynz+1 rows of 2*rxnz+1 */
+  int     rxnz, rynz;
+  double  scale;
+} weights_fixed_t;
+
 weights_t* weights_create(weights_t* weights, convmask_t* convmask);
+weights_t* weights_create_copy(weights_t* weights, int radius, const double* w, int rxnz, int rynz);
+weights_t* weights_share(weights_t* weights, weights_t* src);
 void weights_destroy(weights_t* weights);
 double weights_get(weights_t* weights, int x, int y);
+int weights_factorize(weights_t* weights, double tol);
+weights_t* weights_fold(weights_t* weights, double lambda);
+void weights_unfold(weights_t* weights);
+double weights_folded_get(weights_t* weights, int x, int y);
+int weights_pack(weights_t* weights, int stride);
+weights_t* weights_truncate(weights_t* weights, double loss);
+
+weights_fixed_t* weights_fixed_create(weights_fixed_t* fixed, weights_t* weights);
+void weights_fixed_destroy(weights_fixed_t* fixed);
+double weights_fixed_get(weights_fixed_t* fixed, int x, int y);
 
 #if defined(NDEBUG)
 #include <stdio.h>
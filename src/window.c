@@ -0,0 +1,108 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#include <string.h>
+#include "window.h"
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WINDOW_X86 1
+#include <immintrin.h>
+#endif
+
+#define WINDOW_PASTE(kind, r) window_##kind##_##r
+#define WINDOW_NAME(kind, r) WINDOW_PASTE(kind, r)
+
+#ifdef WINDOW_X86
+
+/* Four bytes at u widened to doubles. */
+__attribute__((target("avx2,fma")))
+static __m256d window_load_u8(const unsigned char* u) {
+  int v;
+  memcpy(&v, u, sizeof(v));
+  return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+}
+
+__attribute__((target("avx2,fma")))
+static double window_hsum(__m256d s) {
+  __m128d h;
+
+  h = _mm_add_pd(_mm256_castpd256_pd128(s), _mm256_extractf128_pd(s, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+}
+
+#endif
+
+#define WINDOW_R 1
+#include "window_kernel.h"
+#undef WINDOW_R
+#define WINDOW_R 2
+#include "window_kernel.h"
+#undef WINDOW_R
+#define WINDOW_R 3
+#include "window_kernel.h"
+#undef WINDOW_R
+#define WINDOW_R 4
+#include "window_kernel.h"
+#undef WINDOW_R
+#define WINDOW_R 5
+#include "window_kernel.h"
+#undef WINDOW_R
+#define WINDOW_R 6
+#include "window_kernel.h"
+#undef WINDOW_R
+#define WINDOW_R 7
+#include "window_kernel.h"
+#undef WINDOW_R
+#define WINDOW_R 8
+#include "window_kernel.h"
+#undef WINDOW_R
+
+#define WINDOW_TABLE(kind) { NULL, \
+  WINDOW_NAME(kind, 1), WINDOW_NAME(kind, 2), WINDOW_NAME(kind, 3), WINDOW_NAME(kind, 4), \
+  WINDOW_NAME(kind, 5), WINDOW_NAME(kind, 6), WINDOW_NAME(kind, 7), WINDOW_NAME(kind, 8) }
+
+static const window_double_u8_t window_double_u8_c[WINDOW_MAX_RADIUS + 1] = WINDOW_TABLE(double_u8_c);
+static const window_short_u8_t window_short_u8_c[WINDOW_MAX_RADIUS + 1] = WINDOW_TABLE(short_u8_c);
+#ifdef WINDOW_X86
+static const window_double_u8_t window_double_u8_avx2[WINDOW_MAX_RADIUS + 1] = WINDOW_TABLE(double_u8_avx2);
+static const window_short_u8_t window_short_u8_avx2[WINDOW_MAX_RADIUS + 1] = WINDOW_TABLE(short_u8_avx2);
+
+/* Nonzero when the AVX2/FMA instances run here. */
+static int window_avx2(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+window_double_u8_t window_double_u8(int rx, int ry) {
+  if (rx != ry || rx < 1 || rx > WINDOW_MAX_RADIUS)
+    return NULL;
+#ifdef WINDOW_X86
+  if (window_avx2()) return window_double_u8_avx2[rx];
+#endif
+  return window_double_u8_c[rx];
+}
+
+window_short_u8_t window_short_u8(int rx, int ry) {
+  if (rx != ry || rx < 1 || rx > WINDOW_MAX_RADIUS)
+    return NULL;
+#ifdef WINDOW_X86
+  if (window_avx2()) return window_short_u8_avx2[rx];
+#endif
+  return window_short_u8_c[rx];
+}
@@ -0,0 +1,44 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef _WINDOW_H
+#define _WINDOW_H
+
+#include "compiler.h"
+
+C_DECL_BEGIN
+
+/* largest radius with a window sum of its own */
+#define WINDOW_MAX_RADIUS 8
+
+/* Sum of the weights w times the bytes u over a square window of
+ * 2*r+1 rows of 2*r+1, u at its top left corner; the rows of w are
+ * wstride apart, those of u stride apart. */
+typedef double (*window_double_u8_t)(const double* w, int wstride, const unsigned char* u, int stride);
+/* As window_double_u8_t with integer weights, the caller keeps the sum
+ * within int. */
+typedef int (*window_short_u8_t)(const short* w, int wstride, const unsigned char* u, int stride);
+
+/* The window sum fully unrolled for the radius rx = ry, AVX2/FMA on
+ * x86 when there is one, or NULL for a window without an instance. */
+window_double_u8_t window_double_u8(int rx, int ry);
+window_short_u8_t window_short_u8(int rx, int ry);
+
+C_DECL_END
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+/* Template of the window sums of a single radius, included by window.c
+ * once for every radius with WINDOW_R set.  The width is a constant, so
+ * the compiler unrolls the rows completely. */
+
+#define WINDOW_M (2 * WINDOW_R + 1)
+
+static double WINDOW_NAME(double_u8_c, WINDOW_R)(const double* w, int wstride, const unsigned char* u, int stride) {
+  double s;
+  int r, i;
+
+  s = 0.0;
+  for (r = 0; r < WINDOW_M; r++) {
+    for (i = 0; i < WINDOW_M; i++) s += w[i] * u[i];
+    w += wstride;
+    u += stride;
+  }
+  return s;
+}
+
+static int WINDOW_NAME(short_u8_c, WINDOW_R)(const short* w, int wstride, const unsigned char* u, int stride) {
+  int s;
+  int r, i;
+
+  s = 0;
+  for (r = 0; r < WINDOW_M; r++) {
+    for (i = 0; i < WINDOW_M; i++) s += w[i] * u[i];
+    w += wstride;
+    u += stride;
+  }
+  return s;
+}
+
+#ifdef WINDOW_X86
+
+__attribute__((target("avx2,fma")))
+static double WINDOW_NAME(double_u8_avx2, WINDOW_R)(const double* w, int wstride, const unsigned char* u, int stride) {
+  __m256d s0, s1;
+  double t;
+  int r, i;
+
+  s0 = s1 = _mm256_setzero_pd();
+  t = 0.0;
+  for (r = 0; r < WINDOW_M; r++) {
+    for (i = 0; i + 8 <= WINDOW_M; i += 8) {
+      s0 = _mm256_fmadd_pd(_mm256_loadu_pd(w + i), window_load_u8(u + i), s0);
+      s1 = _mm256_fmadd_pd(_mm256_loadu_pd(w + i + 4), window_load_u8(u + i + 4), s1);
+    }
+    if (i + 4 <= WINDOW_M) {
+      s0 = _mm256_fmadd_pd(_mm256_loadu_pd(w + i), window_load_u8(u + i), s0);
+      i += 4;
+    }
+    for (; i < WINDOW_M; i++) t += w[i] * u[i];
+    w += wstride;
+    u += stride;
+  }
+  return window_hsum(_mm256_add_pd(s0, s1)) + t;
+}
+
+__attribute__((target("avx2,fma")))
+static int WINDOW_NAME(short_u8_avx2, WINDOW_R)(const short* w, int wstride, const unsigned char* u, int stride) {
+  __m128i s;
+  int t;
+  int r, i;
+
+  s = _mm_setzero_si128();
+  t = 0;
+  for (r = 0; r < WINDOW_M; r++) {
+    for (i = 0; i + 8 <= WINDOW_M; i += 8)
+      s = _mm_add_epi32(s, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(w + i)),
+                                          _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(u + i)))));
+    for (; i < WINDOW_M; i++) t += w[i] * u[i];
+    w += wstride;
+    u += stride;
+  }
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(s) + t;
+}
+
+#endif
+
+#undef WINDOW_M